@@ -1,4 +1,4 @@
-// isactr.cpp : Defines the entry point for the console application.
+// isactr.cpp : the ACT-R engine. main.cpp is its console application.
 //
 
 #include "stdlib.h"
@@ -7,7 +7,19 @@
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
-#include "version.h"
+#include <errno.h>
+#ifdef _MSC_VER
+#include <intrin.h>		// for _BitScanForward, _InterlockedCompareExchange64
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>	// for WaitForSingleObject, GetSystemInfo
+#include <process.h>	// for _beginthreadex
+#else
+#include <unistd.h>		// for fork, pipe
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#endif
 #include "lisp.h"		// "Lisp" functions
 #include "isactr.h"		// isACTR API
 #include "lispactr.h"	// ACT-R-in-Lisp stuff
@@ -23,110 +35,313 @@ One user, one process, one address space, one cognitive instance.
 One big advantage: All the major systems can be singletons if they want to be, which can significantly reduce code
 size and speed up low-level operations, because 'the model' or 'the state' doesn't have to be passed as a pointer
 to every function, even car and consp.
+2026.10.16
+Embedding: a host may want many independent models in one process - a parameter sweep, say. Rather than thread a
+context through every call, which would give up the advantage above, each thread has a current context, reached
+through a thread-local pointer, and the singletons are what it points at. An isactr_context owns its Lisp (heap,
+symbols, code) and its isactr_model, and switching contexts only changes the current pointers. Each thread can run
+its own model at the same time as the others; a context is current on only one thread at a time.
 */
 
 ///////////////////////////////////////////////////////////////////////
 // constants
 
-#define INFINITY (-log(0.0))
+#define TICKS_PER_SECOND 1000000		// the simulation clock counts microseconds
+#define MS_TO_TICKS(ms) ((isactr_time)(ms) * (TICKS_PER_SECOND/1000))
+#define ISACTR_TIME_MAX LLONG_MAX
+
+#ifdef _MSC_VER
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+#define EVENT_SLAB_SIZE 256				// events allocated per slab of the event pool
+
+#define MATCH_BUFFERS 2					// buffers the matcher tracks: GOAL, RETRIEVAL
+#define BITS_PER_WORD 32				// bits in each word of the candidate set
 
 ///////////////////////////////////////////////////////////////////////
 // types and typedefs
 
+typedef long long isactr_time;			// simulation time, in ticks
 typedef void (*isactr_event_action)(struct _isactr_event*);
 typedef wchar_t* chunk_name;
 
 typedef struct _isactr_event {
-	struct _isactr_event*	next;
-	double					time;			// when this event happens
+	struct _isactr_event*	next;			// next free event, while in the pool's free list
+	isactr_time				time;			// when this event happens
 	double					priority;
+	unsigned long long		seq;			// order of scheduling, breaks ties FIFO
+	int						index;			// position of this event in the event heap
+	unsigned				generation;		// bumped each time this record is reused
+	bool					cancelled;		// tombstone: still in the heap, but won't happen
 	bool					requested;
 	isactr_event_action		action;
 	LISPTR					buffer;			// buffer name (SYMBOL)
 	LISPTR					chunk;			// chunk, if any
 } isactr_event;
 
+// A reference to a scheduled event, which a module can keep and later
+// use to cancel the event. Once the event has happened or been cancelled,
+// the event record gets reused and the handle's generation no longer matches.
+typedef struct _isactr_event_handle {
+	isactr_event*			evt;
+	unsigned				generation;
+} isactr_event_handle;
+
+// Pending events, kept as a binary min-heap ordered by precedes().
+typedef struct _isactr_event_queue {
+	isactr_event**			heap;			// heap[0] is the next event to happen
+	int						count;			// number of events in the heap
+	int						capacity;		// allocated size of heap
+	unsigned long long		seq;			// sequence number for the next event pushed
+} isactr_event_queue;
+
+// Events are allocated from slabs owned by the model.
+// Released events go on a free list, and the whole pool can be
+// reset at once when the event queue is cleared.
+typedef struct _isactr_event_slab {
+	struct _isactr_event_slab*	next;		// next slab in the pool
+	isactr_event			events[EVENT_SLAB_SIZE];
+} isactr_event_slab;
+
+typedef struct _isactr_event_pool {
+	isactr_event_slab*		slabs;			// all slabs, in allocation order
+	isactr_event_slab*		current;		// slab events are being carved from
+	int						used;			// events carved so far from current slab
+	isactr_event*			freeList;		// released events, linked through 'next'
+	int						slabCount;		// number of slabs allocated
+	int						live;			// events currently allocated
+	int						peakLive;		// most events ever allocated at once
+} isactr_event_pool;
+
+// Chunks are laid out by chunk-type: each type numbers its slots,
+// and a chunk holds its slot values in an array indexed by those numbers.
+// Slot 0 of every type is ISA, whose value is the type name.
+// Slots a chunk uses that its type didn't declare are added to the type,
+// so a chunk made before that has fewer slots than its type.
+typedef struct _isactr_chunk_type {
+	LISPTR			name;
+	int				slotCount;
+	int				slotCapacity;
+	LISPTR*			slotNames;			// by slot number
+	int*			index;				// hash table of slot numbers by name, -1 = empty
+	int				indexSize;			// a power of 2
+} isactr_chunk_type;
+
+typedef struct _isactr_chunk {
+	LISPTR			name;
+	isactr_chunk_type*	type;
+	int				slotCount;			// length of values
+	int				id;					// DM ordinal, -1 if not in DM
+	LISPTR			values[1];			// by slot number. NULL if the chunk doesn't
+										// have the slot, which is not the same as NIL.
+} isactr_chunk;
+
+// A buffer's own storage for the chunk it holds.
+// A buffer starts out sharing the chunk that was put in it; the first
+// modification copies the chunk here, and later ones change it in place.
+typedef struct _isactr_chunk_store {
+	isactr_chunk*	chunk;				// NULL until first needed
+	int				capacity;			// slot values chunk has room for
+} isactr_chunk_store;
+
 typedef enum {
 	BUFFER_FREE,
 	BUFFER_BUSY,
 	BUFFER_ERROR
 } BufferState;
 
+// The production matcher.
+// Slot tests against a constant value ('alpha' tests) don't depend on
+// variable bindings, so each distinct test is evaluated once when its
+// buffer changes, and shared by every production that contains it.
+// A production is a candidate only while all its alpha tests are true;
+// the full LHS, with its variable tests, is only re-matched for a
+// candidate whose buffers changed since it was last matched.
+// Alpha tests are hashed by (buffer modifier slot value) and grouped by
+// the buffer slot they test. When a buffer changes, only the slots whose
+// values changed are looked at, and on those only the tests that can
+// flip: for = and -, the tests of the slot's old and new values, and for
+// <, <=, > and >=, the tests of numbers between the two.
+// The ISA test is the main case: the users of (GOAL ISA <type>) are the
+// productions for that chunk-type, and they only become candidates when
+// the goal is of that type.
+typedef struct _isactr_alpha_test {
+	int				buffer;				// index of the buffer tested
+	LISPTR			modifier;			// = - < <= > >=
+	LISPTR			slotName;
+	LISPTR			value;				// constant value
+	int				slot;				// its isactr_match_slot in the buffer's slots
+	bool			result;				// this test against the buffer's current contents
+	int*			users;				// productions containing this test
+	int				userCount;
+	int				userCapacity;
+} isactr_alpha_test;
+
+typedef struct _isactr_production {
+	LISPTR			p;					// (name lhs rhs vars)
+	int				alphaFailures;		// how many of its alpha tests are currently false
+	unsigned		buffers;			// bit b is set if the LHS tests buffer b
+	unsigned long	seen[MATCH_BUFFERS];	// buffer versions 'ready' was computed against
+	bool			ready;				// last result of is_ready_to_fire
+	bool			untracked;			// LHS has conditions the matcher can't follow,
+										// so it's re-matched every conflict resolution
+} isactr_production;
+
+// a buffer slot that has alpha tests on it
+typedef struct _isactr_match_slot {
+	LISPTR			slotName;
+	LISPTR			value;				// the slot's value when the buffer last changed,
+										// NULL if the chunk didn't have the slot
+	int				trueAlpha;			// the equality test on this slot that's currently true
+										// or -1 if none
+	int*			unequal;			// its - tests
+	int				unequalCount;
+	int				unequalCapacity;
+	int*			ordered;			// its <, <=, > and >= tests of numbers, by number
+	int				orderedCount;
+	int				orderedCapacity;
+	int*			others;				// tests of anything else, re-evaluated whenever the value changes
+	int				otherCount;
+	int				otherCapacity;
+} isactr_match_slot;
+
+// the slots of one buffer that have alpha tests on them
+typedef struct _isactr_match_buffer {
+	isactr_match_slot*	slots;
+	int				slotCount;
+	int				slotCapacity;
+} isactr_match_buffer;
+
+typedef struct _isactr_matcher {
+	isactr_production*	prods;			// productions, in PM order
+	int				prodCount;
+	int				prodCapacity;
+	isactr_alpha_test*	alphas;			// distinct alpha tests of all productions
+	int				alphaCount;
+	int				alphaCapacity;
+	isactr_match_buffer	buffers[MATCH_BUFFERS];	// the tested slots of each buffer
+	int*			alphaIndex;			// hash table of alpha tests, -1 = empty
+	int				alphaIndexSize;		// a power of 2
+	unsigned*		candidates;			// bit set of productions with no false alpha test
+	int				candidateWords;
+	unsigned long	version[MATCH_BUFFERS];	// bumped whenever a buffer's contents change
+} isactr_matcher;
+
+// Declarative memory index.
+// Each (slot value) pair that occurs in DM has a posting list of the
+// chunks containing it, identified by the order they were added to DM.
+typedef struct _isactr_posting {
+	LISPTR			slotName;
+	LISPTR			value;
+	int*			chunks;				// DM ordinals, ascending
+	int				count;
+	int				capacity;
+} isactr_posting;
+
+typedef struct _isactr_dm_index {
+	isactr_chunk**	chunks;				// DM chunks by ordinal, oldest first
+	int				chunkCount;
+	int				chunkCapacity;
+	isactr_posting*	postings;
+	int				postingCount;
+	int				postingCapacity;
+	int*			table;				// hash table of postings, -1 = empty
+	int				tableSize;			// a power of 2
+} isactr_dm_index;
+
 typedef struct _isactr_model {
 	bool			running;
 	FILE*			in;
 	FILE*			out;
 	FILE*			err;
-	double			time;
-	double			timeLimit;			// max time to run
-	isactr_event	eventQueue;			// queued-up events
-										// the head of the queue is a dummy event
+	isactr_time		time;
+	isactr_time		timeLimit;			// max time to run
+	isactr_event_queue	eventQueue;		// queued-up events
+	isactr_event_pool	eventPool;		// storage for events
 	LISPTR			types;				// list of chunk-types
+	isactr_chunk_type**	chunkTypes;		// layouts of the chunk-types
+	int				chunkTypeCount;
+	int				chunkTypeCapacity;
 	LISPTR			dm;					// list of chunks
+	isactr_dm_index	dmIndex;			// (slot value) index of dm
 	LISPTR			pm;					// list of productions
+	LISPTR			pmLast;				// last cell of pm, for appending
+	isactr_matcher	matcher;			// incremental matcher over pm
 	// state
-	LISPTR			goal;				// contents of GOAL buffer
-	LISPTR			retrieval;			// contents of RETRIEVAL buffer
+	isactr_chunk*	goal;				// contents of GOAL buffer
+	isactr_chunk*	retrieval;			// contents of RETRIEVAL buffer
+	isactr_chunk_store	goalStore;		// GOAL buffer's own copy of its chunk
+	isactr_chunk_store	retrievalStore;	// RETRIEVAL buffer's own copy of its chunk
 	BufferState		retrievalState;
+	isactr_event_handle	retrievalEvent;	// pending event of the retrieval in progress
+	unsigned long long	random;			// state of the model's random stream
+	long long		firings;			// productions fired so far
+	struct _isactr_saved_state*	checkpoints;	// saved states, see isactr_checkpoint
 } isactr_model;
 
 ///////////////////////////////////////////////////////////////////////
 // global variables
 
-isactr_model model;
+static LISP_THREAD isactr_model* model;	// the current context's
 
 // lots of known atoms
-LISPTR GOAL, RETRIEVAL;
-LISPTR SGP, CHUNK_TYPE, ADD_DM, P, GOAL_FOCUS, RIGHT_ARROW;
-LISPTR EQUALS, MINUS, NOT, LT, LEQ, GT, GEQ;
-LISPTR BUFFER_TEST, BUFFER_QUERY;
-LISPTR MOD_BUFFER_CHUNK;
-LISPTR MODULE_REQUEST;
-LISPTR CLEAR_BUFFER;
-LISPTR BANG_OUTPUT;
-LISPTR BANG_EVAL, BANG_SAFE_EVAL;
-LISPTR BANG_BIND, BANG_SAFE_BIND, BANG_MV_BIND;
+LISP_THREAD LISPTR GOAL, RETRIEVAL;
+LISP_THREAD LISPTR ISA;
+LISP_THREAD LISPTR SGP, CHUNK_TYPE, ADD_DM, P, GOAL_FOCUS, RIGHT_ARROW;
+LISP_THREAD LISPTR EQUALS, MINUS, NOT, LT, LEQ, GT, GEQ;
+LISP_THREAD LISPTR BUFFER_TEST, BUFFER_QUERY;
+LISP_THREAD LISPTR MOD_BUFFER_CHUNK;
+LISP_THREAD LISPTR MODULE_REQUEST;
+LISP_THREAD LISPTR CLEAR_BUFFER;
+LISP_THREAD LISPTR BANG_OUTPUT;
+LISP_THREAD LISPTR BANG_EVAL, BANG_SAFE_EVAL;
+LISP_THREAD LISPTR BANG_BIND, BANG_SAFE_BIND, BANG_MV_BIND;
 
 bool inner_trace = false;			// trace internal interpreter activity
 
 ///////////////////////////////////////////////////////////////////////
 // forward function declarations
 void isactr_process_stream(FILE* in, FILE* out, FILE* err);
-isactr_event* isactr_schedule_event(double t, double priority, isactr_event_action action);
+isactr_event* isactr_schedule_event(isactr_time t, double priority, isactr_event_action action);
 void isactr_clear_event_queue(void);
-void isactr_delete_event_by_action(isactr_event_action action);
+bool isactr_cancel_event(isactr_event_handle h);
 void isactr_release_event(isactr_event* evt);
 static void event_action_conflict_resolution(isactr_event* evt);
+static void matcher_buffer_changed(LISPTR buffer);
+static void dm_index_release(isactr_dm_index* ix);
+static void checkpoints_gc_mark(void);
+static void checkpoints_release(void);
+static bool grow_array(void** parray, int* pcapacity, int count, size_t size);
+static unsigned value_hash(LISPTR x);
 void isactr_fire_production(LISPTR p);
 
 ///////////////////////////////////////////////////////////////////////
 // functions
 
-int main(int argc, char* argv[])
-{
-	int i;
-	FILE* in = stdin;
-	FILE* out = stdout;
-	fprintf(out, "Industrial Strength ACT-R  %d.%d.%d.%d\n", VERSION_MAJOR, VERSION_MINOR, VERSION_RELEASE, VERSION_BUILD);
-	// arg 0 is the full path to this executable.
-	for (i = 1; i < argc; i++) {
-		printf("argv[%d] = '%s'\n", i, argv[i]);
-		if (argv[i][0] != '-') {
-			// not an option, assume it's an input file
-			if (in != stdin) {
-				fclose(in);
-			}
-			in = fopen(argv[i], "r");
-			if (!in) {
-				return errno;
-			}
-		}
+// Times are kept in integer ticks so they compare exactly,
+// and only converted to seconds for printing and at the API.
+static inline double ticks_to_seconds(isactr_time t)
+{
+	return (double)t / TICKS_PER_SECOND;
+}
+
+static inline isactr_time seconds_to_ticks(double s)
+{
+	if (s >= (double)ISACTR_TIME_MAX / TICKS_PER_SECOND) {
+		return ISACTR_TIME_MAX;
 	}
-	lisp_init();
+	return (isactr_time)floor(s * TICKS_PER_SECOND + 0.5);
+}
 
-	// create our standard symbols
+// create our standard symbols
+static void init_standard_symbols(void)
+{
 	GOAL = intern(L"GOAL");
 	RETRIEVAL = intern(L"RETRIEVAL");
+	ISA = intern(L"ISA");
 	SGP = intern(L"SGP");
 	CHUNK_TYPE = intern(L"CHUNK-TYPE");
 	ADD_DM = intern(L"ADD-DM");
@@ -151,24 +366,11 @@ int main(int argc, char* argv[])
 	BANG_BIND = intern(L"!BIND!");
 	BANG_SAFE_BIND = intern(L"!SAFE-BIND!");
 	BANG_MV_BIND = intern(L"!MV-BIND!");
-
-	isactr_model_init();
-	init_lisp_actr();
-	model.in = in;
-	model.out = out;
-	model.err = stderr;
-	if (isactr_model_load(in, out, stderr)) {
-		lisp_REPL(stdin, stdout, stderr);
-	}
-	lisp_shutdown();
-	isactr_model_release();
-	fgetwc(stdin);
-	return 0;
 }
 
 void isactr_model_warning(const char* msg)
 {
-	fprintf(model.err, "#|Warning: %s |#", msg);
+	fprintf(model->err, "#|Warning: %s |#", msg);
 }
 
 bool is_variable(LISPTR x)
@@ -182,143 +384,492 @@ static bool precedes(isactr_event* evt1, isactr_event* evt2)
 	if (evt1->time != evt2->time) {
 		return evt1->time < evt2->time;
 	}
+	if (evt1->priority != evt2->priority) {
+		return evt1->priority > evt2->priority;
+	}
 	// note: simultaneous events of equal priority
 	// are queue FIFO.
-	return evt1->priority >= evt2->priority;
+	return evt1->seq < evt2->seq;
+}
+
+// store evt at position i of the event heap
+static inline void heap_place(isactr_event_queue* q, int i, isactr_event* evt)
+{
+	q->heap[i] = evt;
+	evt->index = i;
 }
 
-void isactr_push_event(isactr_event* evt)
+// move the event at position i up until its parent precedes it
+static void heap_sift_up(isactr_event_queue* q, int i)
+{
+	isactr_event* evt = q->heap[i];
+	while (i > 0) {
+		int parent = (i-1) / 2;
+		if (!precedes(evt, q->heap[parent])) {
+			break;
+		}
+		heap_place(q, i, q->heap[parent]);
+		i = parent;
+	}
+	heap_place(q, i, evt);
+} // heap_sift_up
+
+// move the event at position i down until it precedes both its children
+static void heap_sift_down(isactr_event_queue* q, int i)
+{
+	isactr_event* evt = q->heap[i];
+	while (true) {
+		int child = 2*i + 1;
+		if (child >= q->count) {
+			break;
+		}
+		if (child+1 < q->count && precedes(q->heap[child+1], q->heap[child])) {
+			child++;
+		}
+		if (!precedes(q->heap[child], evt)) {
+			break;
+		}
+		heap_place(q, i, q->heap[child]);
+		i = child;
+	}
+	heap_place(q, i, evt);
+} // heap_sift_down
+
+// remove and return the event at position i of the heap
+static isactr_event* heap_remove(isactr_event_queue* q, int i)
+{
+	assert(i >= 0 && i < q->count);
+	isactr_event* evt = q->heap[i];
+	isactr_event* last = q->heap[--q->count];
+	if (i < q->count) {
+		// fill the hole with the last event and restore heap order
+		heap_place(q, i, last);
+		if (i > 0 && precedes(last, q->heap[(i-1)/2])) {
+			heap_sift_up(q, i);
+		} else {
+			heap_sift_down(q, i);
+		}
+	}
+	evt->index = -1;
+	return evt;
+} // heap_remove
+
+bool isactr_push_event(isactr_event* evt)
 {
 	assert(evt != NULL);
 	assert(evt->action != NULL);
-	assert(evt->time >= model.time);
+	assert(evt->time >= model->time);
 
-	isactr_event* p = &model.eventQueue;
-	while (p->next && precedes(p->next, evt)) {
-		p = p->next;
+	isactr_event_queue* q = &model->eventQueue;
+	if (q->count == q->capacity) {
+		int capacity = q->capacity ? 2*q->capacity : 64;
+		isactr_event** heap = (isactr_event**)realloc(q->heap, capacity * sizeof(isactr_event*));
+		if (!heap) {
+			return false;
+		}
+		q->heap = heap;
+		q->capacity = capacity;
 	}
-	// insert e into the list at this point.
-	// The next event in list follows this one:
-	evt->next = p->next;
-	// the previous event in list is followed by this one:
-	p->next = evt;
+	evt->seq = q->seq++;
+	heap_place(q, q->count++, evt);
+	heap_sift_up(q, evt->index);
+	return true;
 } // isactr_push_event
 
 void isactr_delete_event(isactr_event* evt)
 {
 	assert(evt != NULL);
-	// point to dummy head event
-	isactr_event* p = &model.eventQueue;
-	// scan for evt or end of queue
-	while (p->next != evt && (p = p->next)) {}
-	if (p) {
-		assert(p->next == evt);
+	isactr_event_queue* q = &model->eventQueue;
+	if (evt->index >= 0 && evt->index < q->count && q->heap[evt->index] == evt) {
 		// patch out of queue
-		p->next = evt->next;
+		heap_remove(q, evt->index);
 		// release the deleted event
 		isactr_release_event(evt);
 	}
 } // isactr_delete_event
 
-void isactr_delete_event_by_action(isactr_event_action action)
-{
-	assert(action != NULL);
-	isactr_event* p = &model.eventQueue;
-	while (p->next) {
-		// is the next event the one we're looking for?
-		if (p->next->action == action) {
-			// yes: patch it out of the queue
-			isactr_event* evt = p->next;
-			p->next = evt->next;
-			// free the deleted event
-			isactr_release_event(evt);
+isactr_event_handle isactr_event_handle_of(isactr_event* evt)
+{
+	isactr_event_handle h;
+	h.evt = evt;
+	h.generation = evt ? evt->generation : 0;
+	return h;
+} // isactr_event_handle_of
+
+// true if the event h refers to is still in the queue, waiting to happen
+bool isactr_event_pending(isactr_event_handle h)
+{
+	isactr_event* evt = h.evt;
+	isactr_event_queue* q = &model->eventQueue;
+	return evt &&
+		   evt->generation == h.generation &&
+		   !evt->cancelled &&
+		   evt->index >= 0 && evt->index < q->count &&
+		   q->heap[evt->index] == evt;
+} // isactr_event_pending
+
+// Cancel the event h refers to, if it hasn't happened yet.
+// The event is only marked: it stays in the heap until it reaches
+// the front of the queue, and is then discarded.
+// Returns true if an event was cancelled.
+bool isactr_cancel_event(isactr_event_handle h)
+{
+	if (!isactr_event_pending(h)) {
+		return false;
+	}
+	h.evt->cancelled = true;
+	return true;
+} // isactr_cancel_event
+
+// index of slotName in chunk-type ct, -1 if ct has no such slot
+static int chunk_type_slot(isactr_chunk_type* ct, LISPTR slotName)
+{
+	unsigned mask = ct->indexSize - 1;
+	for (unsigned h = value_hash(slotName) & mask; ct->index[h] >= 0; h = (h+1) & mask) {
+		if (ct->slotNames[ct->index[h]] == slotName) {
+			return ct->index[h];
+		}
+	}
+	return -1;
+} // chunk_type_slot
+
+static void chunk_type_index_slot(isactr_chunk_type* ct, int n)
+{
+	unsigned mask = ct->indexSize - 1;
+	unsigned h = value_hash(ct->slotNames[n]) & mask;
+	while (ct->index[h] >= 0) {
+		h = (h+1) & mask;
+	}
+	ct->index[h] = n;
+} // chunk_type_index_slot
+
+// Number of slotName in ct, adding it to ct if it's new.
+// Returns -1 if out of memory.
+static int chunk_type_add_slot(isactr_chunk_type* ct, LISPTR slotName)
+{
+	int n = chunk_type_slot(ct, slotName);
+	if (n >= 0) {
+		return n;
+	}
+	if (!grow_array((void**)&ct->slotNames, &ct->slotCapacity, ct->slotCount, sizeof(LISPTR))) {
+		return -1;
+	}
+	if (2 * (ct->slotCount+1) > ct->indexSize) {
+		// keep the index at most half full
+		int size = 2 * ct->indexSize;
+		int* index = (int*)malloc(size * sizeof(int));
+		if (!index) {
+			return -1;
+		}
+		for (int h = 0; h < size; h++) {
+			index[h] = -1;
+		}
+		free(ct->index);
+		ct->index = index;
+		ct->indexSize = size;
+		for (int k = 0; k < ct->slotCount; k++) {
+			chunk_type_index_slot(ct, k);
+		}
+	}
+	n = ct->slotCount++;
+	ct->slotNames[n] = slotName;
+	chunk_type_index_slot(ct, n);
+	return n;
+} // chunk_type_add_slot
+
+// Find the layout of the chunk-type with this name, creating it if need be.
+// Returns NULL if out of memory.
+static isactr_chunk_type* find_chunk_type(LISPTR name)
+{
+	for (int i = 0; i < model->chunkTypeCount; i++) {
+		if (model->chunkTypes[i]->name == name) {
+			return model->chunkTypes[i];
+		}
+	}
+	if (!grow_array((void**)&model->chunkTypes, &model->chunkTypeCapacity, model->chunkTypeCount, sizeof(isactr_chunk_type*))) {
+		return NULL;
+	}
+	isactr_chunk_type* ct = (isactr_chunk_type*)malloc(sizeof(isactr_chunk_type));
+	if (!ct) {
+		return NULL;
+	}
+	ct->name = name;
+	ct->slotCount = 0;
+	ct->slotCapacity = 0;
+	ct->slotNames = NULL;
+	ct->indexSize = 8;
+	ct->index = (int*)malloc(ct->indexSize * sizeof(int));
+	if (!ct->index) {
+		free(ct);
+		return NULL;
+	}
+	for (int h = 0; h < ct->indexSize; h++) {
+		ct->index[h] = -1;
+	}
+	if (chunk_type_add_slot(ct, ISA) != 0) {
+		free(ct->index);
+		free(ct);
+		return NULL;
+	}
+	model->chunkTypes[model->chunkTypeCount++] = ct;
+	return ct;
+} // find_chunk_type
+
+static void release_chunk_types(void)
+{
+	for (int i = 0; i < model->chunkTypeCount; i++) {
+		free(model->chunkTypes[i]->slotNames);
+		free(model->chunkTypes[i]->index);
+		free(model->chunkTypes[i]);
+	}
+	free(model->chunkTypes);
+	model->chunkTypes = NULL;
+	model->chunkTypeCount = 0;
+	model->chunkTypeCapacity = 0;
+} // release_chunk_types
+
+// allocate a chunk of type ct with room for all its slots, none of them set
+static isactr_chunk* make_chunk(LISPTR name, isactr_chunk_type* ct)
+{
+	int n = ct->slotCount;
+	isactr_chunk* chunk = (isactr_chunk*)malloc(sizeof(isactr_chunk) + (n-1) * sizeof(LISPTR));
+	if (chunk) {
+		chunk->name = name;
+		chunk->type = ct;
+		chunk->slotCount = n;
+		chunk->id = -1;
+		for (int i = 0; i < n; i++) {
+			chunk->values[i] = NULL;
+		}
+	}
+	return chunk;
+} // make_chunk
+
+// value of slot slotName in chunk, NULL if chunk doesn't have that slot
+static LISPTR chunk_slot(isactr_chunk* chunk, LISPTR slotName)
+{
+	if (!chunk) {
+		return NULL;
+	}
+	int n = chunk_type_slot(chunk->type, slotName);
+	return (n >= 0 && n < chunk->slotCount) ? chunk->values[n] : NULL;
+} // chunk_slot
+
+// Make a chunk from its list form: (<name> {<slot> <value>}*)
+// The chunk-type is the value of the first ISA slot. If a slot is
+// repeated, the first value is the one that counts.
+// Returns NULL if out of memory.
+static isactr_chunk* chunk_from_list(LISPTR def)
+{
+	LISPTR slots = cdr(def);
+	LISPTR typeName = NIL;
+	for (LISPTR p = slots; consp(p); p = cddr(p)) {
+		if (car(p) == ISA) {
+			typeName = cadr(p);
 			break;
 		}
-		p = p->next;
 	}
-} // isactr_delete_event_by_action
+	isactr_chunk_type* ct = find_chunk_type(typeName);
+	if (!ct) {
+		return NULL;
+	}
+	// make sure the type has all the chunk's slots
+	for (LISPTR p = slots; consp(p); p = cddr(p)) {
+		if (chunk_type_add_slot(ct, car(p)) < 0) {
+			return NULL;
+		}
+	}
+	isactr_chunk* chunk = make_chunk(car(def), ct);
+	if (chunk) {
+		for (LISPTR p = slots; consp(p); p = cddr(p)) {
+			int n = chunk_type_slot(ct, car(p));
+			if (chunk->values[n] == NULL) {
+				chunk->values[n] = cadr(p);
+			}
+		}
+	}
+	return chunk;
+} // chunk_from_list
+
+// Make store hold at least n slot values. Returns false if out of memory.
+static bool reserve_chunk_store(isactr_chunk_store* store, int n)
+{
+	if (store->chunk && n <= store->capacity) {
+		return true;
+	}
+	isactr_chunk* chunk = (isactr_chunk*)realloc(store->chunk, sizeof(isactr_chunk) + (n-1) * sizeof(LISPTR));
+	if (!chunk) {
+		return false;
+	}
+	store->chunk = chunk;
+	store->capacity = n;
+	return true;
+} // reserve_chunk_store
+
+// Copy chunk into store, laid out as chunk-type ct.
+// The slots are carried over by name. Returns false if out of memory.
+static bool copy_chunk_to_store(isactr_chunk_store* store, isactr_chunk* chunk, isactr_chunk_type* ct)
+{
+	for (int i = 1; chunk && i < chunk->slotCount; i++) {
+		if (chunk->values[i] && chunk_type_add_slot(ct, chunk->type->slotNames[i]) < 0) {
+			return false;
+		}
+	}
+	isactr_chunk* copy;
+	if (chunk && chunk == store->chunk) {
+		// changing the type of the store's own chunk: lay it out afresh
+		copy = make_chunk(chunk->name, ct);
+		if (!copy) {
+			return false;
+		}
+	} else {
+		if (!reserve_chunk_store(store, ct->slotCount)) {
+			return false;
+		}
+		copy = store->chunk;
+		copy->name = chunk ? chunk->name : NIL;
+		copy->type = ct;
+		copy->slotCount = ct->slotCount;
+		copy->id = -1;
+		for (int i = 0; i < copy->slotCount; i++) {
+			copy->values[i] = NULL;
+		}
+	}
+	for (int i = 0; chunk && i < chunk->slotCount; i++) {
+		if (chunk->values[i]) {
+			copy->values[chunk_type_slot(ct, chunk->type->slotNames[i])] = chunk->values[i];
+		}
+	}
+	if (copy != store->chunk) {
+		free(store->chunk);
+		store->chunk = copy;
+		store->capacity = ct->slotCount;
+	}
+	return true;
+} // copy_chunk_to_store
+
+// Set slot slotName of the chunk in a buffer to value.
+// *pbuffer is the buffer's contents, store is its own storage.
+// Setting ISA changes the chunk's type, carrying the other slots over by name.
+// Returns false if out of memory.
+static bool buffer_set_slot(isactr_chunk** pbuffer, isactr_chunk_store* store, LISPTR slotName, LISPTR value)
+{
+	isactr_chunk* chunk = *pbuffer;
+	isactr_chunk_type* ct = chunk ? chunk->type : find_chunk_type(NIL);
+	if (slotName == ISA) {
+		ct = find_chunk_type(value);
+	}
+	if (!ct || chunk_type_add_slot(ct, slotName) < 0) {
+		return false;
+	}
+	if (!chunk || chunk != store->chunk || chunk->type != ct) {
+		// first modification, or a new type: copy the chunk into the buffer's storage
+		if (!copy_chunk_to_store(store, chunk, ct)) {
+			return false;
+		}
+		chunk = *pbuffer = store->chunk;
+	} else if (chunk->slotCount < ct->slotCount) {
+		// the type has gained slots since the chunk was copied
+		if (!reserve_chunk_store(store, ct->slotCount)) {
+			return false;
+		}
+		chunk = *pbuffer = store->chunk;
+		while (chunk->slotCount < ct->slotCount) {
+			chunk->values[chunk->slotCount++] = NULL;
+		}
+	}
+	chunk->values[chunk_type_slot(ct, slotName)] = value;
+	return true;
+} // buffer_set_slot
+
+// print the slots of a chunk, as a list (<slot> <value> ...)
+static void print_chunk(isactr_chunk* chunk, FILE* out)
+{
+	const char* sep = "";
+	fputs("(", out);
+	for (int i = 0; chunk && i < chunk->slotCount; i++) {
+		if (chunk->values[i]) {
+			fprintf(out, "%s%s ", sep, string_text(symbol_name(chunk->type->slotNames[i])));
+			lisp_print(chunk->values[i], out);
+			sep = " ";
+		}
+	}
+	fputs(")", out);
+} // print_chunk
 
 static void event_action_null(isactr_event* evt)
 {
-	fprintf(model.out, "     %5.3f   ------                 %s\n",
-		model.time, "-no action specified-");
+	fprintf(model->out, "     %5.3f   ------                 %s\n",
+		ticks_to_seconds(model->time), "-no action specified-");
 }
 
 static void event_action_buffer_read_action(isactr_event* evt)
 {
 	LISPTR buffer = evt->buffer;
-	fprintf(model.out, "     %5.3f   %-22ls %s %ls\n",
-		model.time, L"PROCEDURAL", "BUFFER-READ-ACTION", string_text(symbol_name(buffer)));
+	fprintf(model->out, "     %5.3f   %-22s %s %s\n",
+		ticks_to_seconds(model->time), "PROCEDURAL", "BUFFER-READ-ACTION", string_text(symbol_name(buffer)));
 }
 
 static void event_action_retrieval_failure(isactr_event* evt)
 {
-	fprintf(model.out, "     %5.3f   %-22ls %s\n",
-		model.time, L"DECLARATIVE", "RETRIEVAL-FAILURE");
-	model.retrievalState = BUFFER_ERROR;
+	fprintf(model->out, "     %5.3f   %-22s %s\n",
+		ticks_to_seconds(model->time), "DECLARATIVE", "RETRIEVAL-FAILURE");
+	model->retrievalState = BUFFER_ERROR;
 }
 
-// evt->buffer is buffer, evt->chunk = full chunk, car=name
+// evt->buffer is buffer, evt->chunk = the chunk (isactr_chunk*)
 static void event_action_set_buffer_chunk(isactr_event* evt)
 {
-	LISPTR chunk = evt->chunk;
-	if (!consp(chunk)) {
+	if (evt->chunk == NIL || evt->chunk == NULL) {
 		lisp_error(L"set_buffer_chunk: bad chunk");
 		return;
 	}
-	LISPTR chunkName = car(evt->chunk);
-	chunk = cdr(chunk);					// don't include chunk-name in buffer
+	isactr_chunk* chunk = (isactr_chunk*)evt->chunk;
+	LISPTR chunkName = chunk->name;
 
 	// put the chunk in the designated buffer
 	LISPTR buffer = evt->buffer;
-	const wchar_t* area = L"<buffer?>";
+	const char* area = "<buffer?>";
 	if (buffer == GOAL) {
-		model.goal = chunk;
-		area = L"GOAL";
+		model->goal = chunk;
+		area = "GOAL";
 	} else if (buffer == RETRIEVAL) {
-		model.retrieval = chunk;
-		area = L"DECLARATIVE";
+		model->retrieval = chunk;
+		area = "DECLARATIVE";
 	}
+	matcher_buffer_changed(buffer);
 
-	fprintf(model.out, "     %5.3f   %-22ls %s %ls %ls %s\n",
-		model.time, area, "SET-BUFFER-CHUNK",
+	fprintf(model->out, "     %5.3f   %-22s %s %s %s %s\n",
+		ticks_to_seconds(model->time), area, "SET-BUFFER-CHUNK",
 		string_text(symbol_name(evt->buffer)), string_text(symbol_name(chunkName)), 
 		(evt->requested ? "" : "REQUESTED NIL")
 		);
 
-	isactr_schedule_event(model.time, PRIORITY_MIN, event_action_conflict_resolution);
+	isactr_schedule_event(model->time, PRIORITY_MIN, event_action_conflict_resolution);
 
 	if (inner_trace) {
-		printf("--goal:      "); lisp_print(model.goal, stdout); printf("\n");
-		printf("--retrieval: "); lisp_print(model.retrieval, stdout); printf("\n");
+		printf("--goal:      "); print_chunk(model->goal, stdout); printf("\n");
+		printf("--retrieval: "); print_chunk(model->retrieval, stdout); printf("\n");
 	}
 } // event_action_set_buffer_chunk
 
-static LISPTR modify_chunk(LISPTR chunk, LISPTR slotName, LISPTR value)
-{
-	if (consp(chunk)) {
-		if (car(chunk)==slotName) {
-			return cons(slotName, cons(value, cddr(chunk)));
-		} else {
-			return cons(car(chunk), cons(cadr(chunk), modify_chunk(cddr(chunk), slotName, value)));
-		}
-	}
-	return cons(slotName, cons(value, NIL));
-} // modify_chunk
-
 static void event_action_mod_buffer(isactr_event* evt)
 {
 	LISPTR buffer = evt->buffer;
 	LISPTR action = evt->chunk;
-	fprintf(model.out, "     %5.3f   %-22ls %s %ls\n",
-		model.time, L"PROCEDURAL", "MOD-BUFFER-CHUNK", string_text(symbol_name(buffer)));
-	LISPTR* pbuffer = NULL;
+	fprintf(model->out, "     %5.3f   %-22s %s %s\n",
+		ticks_to_seconds(model->time), "PROCEDURAL", "MOD-BUFFER-CHUNK", string_text(symbol_name(buffer)));
+	isactr_chunk** pbuffer = NULL;
+	isactr_chunk_store* store = NULL;
 	if (buffer == GOAL) {
-		pbuffer = &model.goal;
+		pbuffer = &model->goal;
+		store = &model->goalStore;
 	} else if (buffer == RETRIEVAL) {
-		pbuffer = &model.retrieval;
+		pbuffer = &model->retrieval;
+		store = &model->retrievalStore;
 	} else {
-		fprintf(model.err, "unknown buffer (%ls) in RHS action", string_text(symbol_name(buffer)));
+		fprintf(model->err, "unknown buffer (%s) in RHS action", string_text(symbol_name(buffer)));
+		return;
 	}
 	while (consp(action)) {
 		LISPTR slotName = car(action);
@@ -326,24 +877,27 @@ static void event_action_mod_buffer(isactr_event* evt)
 		if (consp(value)) {
 			value = cdr(value);
 		}
-		*pbuffer = modify_chunk(*pbuffer, slotName, value);
+		if (!buffer_set_slot(pbuffer, store, slotName, value)) {
+			fprintf(model->err, "out of memory in MOD-BUFFER-CHUNK\n");
+			break;
+		}
 		action = cddr(action);
 	}
+	matcher_buffer_changed(buffer);
 	if (inner_trace) {
-		fprintf(model.out, "--goal:      "); lisp_print(model.goal, stdout); fprintf(model.out, "\n");
-		fprintf(model.out, "--retrieval: "); lisp_print(model.retrieval, stdout); fprintf(model.out, "\n");
+		fprintf(model->out, "--goal:      "); print_chunk(model->goal, stdout); fprintf(model->out, "\n");
+		fprintf(model->out, "--retrieval: "); print_chunk(model->retrieval, stdout); fprintf(model->out, "\n");
 	}
 } // event_action_mod_buffer
 
 static void event_action_retrieved(isactr_event* evt)
 {
-	LISPTR chunk = evt->chunk;				// includes car=name
-	LISPTR chunkName = car(evt->chunk);
+	LISPTR chunkName = ((isactr_chunk*)evt->chunk)->name;
 
-	fprintf(model.out, "     %5.3f   %-22ls %s %ls\n",
-		model.time, L"DECLARATIVE", "RETRIEVED-CHUNK", string_text(symbol_name(chunkName)));
-	model.retrievalState = BUFFER_FREE;
-	isactr_event* evt2 = isactr_schedule_event(model.time, PRIORITY_MAX, event_action_set_buffer_chunk);
+	fprintf(model->out, "     %5.3f   %-22s %s %s\n",
+		ticks_to_seconds(model->time), "DECLARATIVE", "RETRIEVED-CHUNK", string_text(symbol_name(chunkName)));
+	model->retrievalState = BUFFER_FREE;
+	isactr_event* evt2 = isactr_schedule_event(model->time, PRIORITY_MAX, event_action_set_buffer_chunk);
 	evt2->buffer = RETRIEVAL;
 	evt2->chunk = evt->chunk;
 	evt2->requested = true;
@@ -354,32 +908,34 @@ static void event_action_start_retrieval(isactr_event* evt)
 	// buffer is understood to be RETRIEVAL
 	// 'chunk' is the pattern for the chunk to be retrieved
 	LISPTR pattern = evt->chunk;
-	fprintf(model.out, "     %5.3f   %-22ls %s\n",
-		model.time, L"DECLARATIVE", "START-RETRIEVAL");
+	fprintf(model->out, "     %5.3f   %-22s %s\n",
+		ticks_to_seconds(model->time), "DECLARATIVE", "START-RETRIEVAL");
 	LISPTR chunk = isactr_retrieve_chunk(pattern);
-	// Note, includes name = car(chunk)
 	if (chunk == NIL) {
 		// retrieval failed
-		evt = isactr_schedule_event(model.time+0.050, PRIORITY_0, event_action_retrieval_failure);
+		evt = isactr_schedule_event(model->time+MS_TO_TICKS(50), PRIORITY_0, event_action_retrieval_failure);
 	} else {
-		evt = isactr_schedule_event(model.time+0.050, PRIORITY_0, event_action_retrieved);
+		evt = isactr_schedule_event(model->time+MS_TO_TICKS(50), PRIORITY_0, event_action_retrieved);
 		evt->chunk = chunk;
 	}
+	// the retrieval is still in progress until that event happens
+	model->retrievalEvent = isactr_event_handle_of(evt);
 }
 
 static void event_action_production_fired(isactr_event* evt)
 {
 	LISPTR p = evt->chunk;		// the production that fired
 	LISPTR pname = car(p);
-	fprintf(model.out, "     %5.3f   %-22ls %s %ls\n",
-		model.time, L"PROCEDURAL", "PRODUCTION-FIRED", string_text(symbol_name(pname)));
+	fprintf(model->out, "     %5.3f   %-22s %s %s\n",
+		ticks_to_seconds(model->time), "PROCEDURAL", "PRODUCTION-FIRED", string_text(symbol_name(pname)));
+	model->firings++;
 	isactr_fire_production(p);
-	evt = isactr_schedule_event(model.time, PRIORITY_MIN, event_action_conflict_resolution);
+	evt = isactr_schedule_event(model->time, PRIORITY_MIN, event_action_conflict_resolution);
 }
 
 static bool action_buffer_modification(LISPTR action)
 {
-	isactr_event* evt = isactr_schedule_event(model.time, PRIORITY_100, event_action_mod_buffer);
+	isactr_event* evt = isactr_schedule_event(model->time, PRIORITY_100, event_action_mod_buffer);
 	evt->buffer = car(action);
 	evt->chunk = cdr(action);
 	return true;
@@ -388,18 +944,19 @@ static bool action_buffer_modification(LISPTR action)
 static void event_action_clear_buffer(isactr_event* evt)
 {
 	LISPTR buffer = evt->buffer;
-	fprintf(model.out, "     %5.3f   %-22ls %s %ls\n",
-		model.time, L"PROCEDURAL", "CLEAR-BUFFER", string_text(symbol_name(buffer)));
+	fprintf(model->out, "     %5.3f   %-22s %s %s\n",
+		ticks_to_seconds(model->time), "PROCEDURAL", "CLEAR-BUFFER", string_text(symbol_name(buffer)));
 	if (buffer == GOAL) {
-		model.goal = NIL;
+		model->goal = NULL;
 	} else if (buffer == RETRIEVAL) {
-		model.retrieval = NIL;
+		model->retrieval = NULL;
 	}
+	matcher_buffer_changed(buffer);
 }
 
 static bool action_clear_buffer(LISPTR action)
 {
-	isactr_event* evt = isactr_schedule_event(model.time, PRIORITY_10, event_action_clear_buffer);
+	isactr_event* evt = isactr_schedule_event(model->time, PRIORITY_10, event_action_clear_buffer);
 	evt->buffer = car(action);
 	return true;
 }
@@ -407,67 +964,102 @@ static bool action_clear_buffer(LISPTR action)
 static void event_action_module_request(isactr_event* evt)
 {
 	LISPTR buffer = evt->buffer;
-	fprintf(model.out, "     %5.3f   %-22ls %s %ls\n",
-		model.time, L"PROCEDURAL", "MODULE-REQUEST", string_text(symbol_name(buffer)));
+	fprintf(model->out, "     %5.3f   %-22s %s %s\n",
+		ticks_to_seconds(model->time), "PROCEDURAL", "MODULE-REQUEST", string_text(symbol_name(buffer)));
 
 	if (buffer==RETRIEVAL) {
-		if (model.retrievalState == BUFFER_BUSY) {
+		if (model->retrievalState == BUFFER_BUSY) {
 			isactr_model_warning("A retrieval event has been aborted by a new request");
-			isactr_delete_event_by_action(event_action_start_retrieval);
+			isactr_cancel_event(model->retrievalEvent);
 		}
-		model.retrievalState = BUFFER_FREE;
-		isactr_event* evt2 = isactr_schedule_event(model.time, -2000, event_action_start_retrieval);
+		model->retrievalState = BUFFER_FREE;
+		isactr_event* evt2 = isactr_schedule_event(model->time, -2000, event_action_start_retrieval);
 		evt2->chunk = evt->chunk;
-		model.retrievalState = BUFFER_BUSY;
+		model->retrievalEvent = isactr_event_handle_of(evt2);
+		model->retrievalState = BUFFER_BUSY;
 	}
 }
 
 static bool action_module_request(LISPTR action)
 {
 	LISPTR buffer = car(action);
-	isactr_event* evt = isactr_schedule_event(model.time, PRIORITY_50, event_action_module_request);
+	isactr_event* evt = isactr_schedule_event(model->time, PRIORITY_50, event_action_module_request);
 	evt->buffer = buffer;
 	evt->chunk = cdr(action);
 
-	isactr_schedule_event(model.time, PRIORITY_10, event_action_clear_buffer)->buffer = buffer;
+	isactr_schedule_event(model->time, PRIORITY_10, event_action_clear_buffer)->buffer = buffer;
 	return true;
 }
 
+// Return form with each variable binding in it replaced by its value.
+// Loops down lists and recurses only into elements that are lists.
+// Only the cells in front of the last replacement are copied: if nothing
+// is replaced, form itself is returned.
 static LISPTR eval_form_with_vars(LISPTR form)
 {
-	if (!consp(form)) {
-		return form;
-	}
-	if (is_variable(car(form))) {
-		return cdr(form);
+	LISPTR head = NIL, last = NIL;		// the copy, once anything is replaced
+	LISPTR shared = form;				// first cell not yet copied
+	LISPTR p = form;
+	while (consp(p)) {
+		LISPTR item = car(p);
+		LISPTR rest;					// what follows the copied cells
+		if (is_variable(item)) {
+			// p is a binding (<var> . <value>)
+			rest = cdr(p);
+		} else {
+			LISPTR x = eval_form_with_vars(item);
+			if (x == item) {
+				p = cdr(p);
+				continue;
+			}
+			rest = cons(x, NIL);
+		}
+		// copy the unchanged cells before p, then add rest
+		for (; shared != p; shared = cdr(shared)) {
+			LISPTR cell = cons(car(shared), NIL);
+			if (head == NIL) {
+				head = cell;
+			} else {
+				rplacd(last, cell);
+			}
+			last = cell;
+		}
+		if (head == NIL) {
+			head = rest;
+		} else {
+			rplacd(last, rest);
+		}
+		if (is_variable(item)) {
+			return head;
+		}
+		last = rest;
+		p = shared = cdr(p);
 	}
-	LISPTR x = eval_form_with_vars(car(form));
-	LISPTR y = eval_form_with_vars(cdr(form));
-	if (x != car(form) || y != cdr(form)) {
-		return cons(x,y);
-	} else {
+	if (head == NIL) {
 		return form;
 	}
-}
+	rplacd(last, shared);
+	return head;
+} // eval_form_with_vars
 
 static bool action_output(LISPTR action)
 {
 	LISPTR form = eval_form_with_vars(car(action));
 	while (consp(form)) {
-		lisp_print(car(form), model.out);
-		fprintf(model.out, " ");
+		lisp_print(car(form), model->out);
+		fprintf(model->out, " ");
 		form = cdr(form);
 	}
 	if (form != NIL) {
-		lisp_print(form, model.out);
+		lisp_print(form, model->out);
 	}
-	fprintf(model.out, "\n");
+	fprintf(model->out, "\n");
 	return true;
 }
 
 static bool action_eval(LISPTR action)
 {
-	fprintf(model.out, "** !eval! not implemented\n");
+	fprintf(model->out, "** !eval! not implemented\n");
 	return false;
 }
 
@@ -489,7 +1081,7 @@ bool apply_action(LISPTR action)
 	} else if (op == BANG_EVAL) {
 		return action_eval(action);
 	}
-	fprintf(model.err, "invalid RHS action type: %ls\n", string_text(symbol_name(op)));
+	fprintf(model->err, "invalid RHS action type: %s\n", string_text(symbol_name(op)));
 	return false;
 }
 
@@ -508,70 +1100,65 @@ void isactr_fire_production(LISPTR p)
 // true if the named slot is in the chunk and its value matches the specified value.
 // Note that (for equality only) value can be a (var.val) pair, which is matched if
 // val != NIL, or bound if if val==NIL.
-static bool slot_match(LISPTR chunk, LISPTR modifier, LISPTR slotName, LISPTR value)
+static bool slot_match(isactr_chunk* chunk, LISPTR modifier, LISPTR slotName, LISPTR value)
 {
 	bool bResult = false;
 	if (inner_trace) {
-		fprintf(model.out, "slot_match %ls %ls, ", string_text(symbol_name(modifier)), string_text(symbol_name(slotName)));
-		lisp_print(value, stdout); fprintf(model.out, ", "); lisp_print(chunk, stdout);
-	}
-	while (consp(chunk)) {
-		if (car(chunk) == slotName) {
-			// slot found, match the value
-			LISPTR slotVal = cadr(chunk);
-			bool bMatch;
-			if (modifier == EQUALS) {
-				if (!consp(value)) {
-					// atomic value, must be eql to slot value
-					bMatch = eql(value, slotVal);
-				} else if (cdr(value)!=NIL) {
-					// variable (var.val) compare to 
-					bMatch = eql(cdr(value), slotVal);
-				} else if (slotVal != NIL) {
-					// unbound variable, bind to value from slot
-					rplacd(value, slotVal);
-					bMatch = true;
+		fprintf(model->out, "slot_match %s %s, ", string_text(symbol_name(modifier)), string_text(symbol_name(slotName)));
+		lisp_print(value, stdout); fprintf(model->out, ", "); print_chunk(chunk, stdout);
+	}
+	LISPTR slotVal = chunk_slot(chunk, slotName);
+	if (slotVal != NULL) {
+		// slot found, match the value
+		bool bMatch = false;
+		if (modifier == EQUALS) {
+			if (!consp(value)) {
+				// atomic value, must be eql to slot value
+				bMatch = eql(value, slotVal);
+			} else if (cdr(value)!=NIL) {
+				// variable (var.val) compare to 
+				bMatch = eql(cdr(value), slotVal);
+			} else if (slotVal != NIL) {
+				// unbound variable, bind to value from slot
+				rplacd(value, slotVal);
+				bMatch = true;
+			} else {
+				bMatch = false;
+			}
+		} else if (modifier == MINUS) {
+			if (consp(value)) {
+				value = cdr(value);
+			}
+			bMatch = !eql(value, slotVal);
+		} else {
+			// inequality: = [< | > | <= | >=] - Only applies to numbers.
+			if (consp(value)) {
+				value = cdr(value);
+			}
+			if (numberp(value) && numberp(slotVal)) {
+				double dValue = number_value(value);
+				double dSlotVal = number_value(slotVal);
+				if (modifier == LT) {
+					bMatch = (dValue < dSlotVal);
+				} else if (modifier == LEQ) {
+					bMatch = (dValue <= dSlotVal);
+				} else if (modifier == GT) {
+					bMatch = (dValue > dSlotVal);
+				} else if (modifier == GEQ) {
+					bMatch = (dValue >= dSlotVal);
 				} else {
+					lisp_error(L"invalid slot modifier");
 					bMatch = false;
 				}
-			} else if (modifier == MINUS) {
-				if (consp(value)) {
-					value = cdr(value);
-				}
-				bMatch = !eql(value, slotVal);
-			} else {
-				// inequality: = [< | > | <= | >=] - Only applies to numbers.
-				if (consp(value)) {
-					value = cdr(value);
-				}
-				if (numberp(value) && numberp(slotVal)) {
-					double dValue = number_value(value);
-					double dSlotVal = number_value(slotVal);
-					if (modifier == LT) {
-						bMatch = (dValue < dSlotVal);
-					} else if (modifier == LEQ) {
-						bMatch = (dValue <= dSlotVal);
-					} else if (modifier == GT) {
-						bMatch = (dValue > dSlotVal);
-					} else if (modifier == GEQ) {
-						bMatch = (dValue >= dSlotVal);
-					} else {
-						lisp_error(L"invalid slot modifier");
-						bMatch = false;
-					}
-				}
 			}
-			bResult = bMatch;
-			break;
 		}
-		chunk = cddr(chunk);
-	}
-	if (chunk==NIL && value==NIL) {
+		bResult = bMatch;
+	} else if (value==NIL) {
 		// Treat slot not found same as (slot NIL).
 		bResult = true;
 	}
 	if (inner_trace) {
-		fprintf(model.out, " => %s\n", bResult ? "true" : "false");
+		fprintf(model->out, " => %s\n", bResult ? "true" : "false");
 	}
 	return bResult;
 } // slot_match
@@ -580,13 +1167,13 @@ static bool slot_match(LISPTR chunk, LISPTR modifier, LISPTR slotName, LISPTR va
 static bool buffer_test(LISPTR buffer, LISPTR cond)
 {
 	// get the contents of the specified buffer
-	LISPTR contents = NIL;
+	isactr_chunk* contents = NULL;
 	if (buffer == GOAL) {
-		contents = model.goal;
+		contents = model->goal;
 	} else if (buffer == RETRIEVAL) {
-		contents = model.retrieval;
+		contents = model->retrieval;
 	} else {
-		fprintf(model.err, "unknown buffer (%ls) in LHS clause", string_text(symbol_name(buffer)));
+		fprintf(model->err, "unknown buffer (%s) in LHS clause", string_text(symbol_name(buffer)));
 		return false;
 	}
 	// match the buffer contents against the rest of the cond clause
@@ -606,7 +1193,7 @@ static bool buffer_test(LISPTR buffer, LISPTR cond)
 
 static bool buffer_query(LISPTR buffer, LISPTR cond)
 {
-	fprintf(model.err, "buffer queries not implemented\n");
+	fprintf(model->err, "buffer queries not implemented\n");
 	return false;
 } // buffer_query
 
@@ -620,10 +1207,10 @@ static bool test_condition(LISPTR cond)
 		return buffer_query(car(cond), cdr(cond));
 	} else if (op == BANG_EVAL || op == BANG_SAFE_EVAL
 		    || op == BANG_BIND || op == BANG_SAFE_BIND || op == BANG_MV_BIND) {
-		fprintf(model.err, "%ls is not currently supported in LHS condition\n", string_text(symbol_name(op)));
+		fprintf(model->err, "%s is not currently supported in LHS condition\n", string_text(symbol_name(op)));
 		return false;
 	}
-	fprintf(model.err, "invalid condition test: %ls\n", string_text(symbol_name(op)));
+	fprintf(model->err, "invalid condition test: %s\n", string_text(symbol_name(op)));
 	return false;
 } // test_condition
 
@@ -652,7 +1239,7 @@ static void reset_variables(LISPTR vars)
 static bool is_ready_to_fire(LISPTR p)
 {
 	if (inner_trace) {
-		fprintf(model.out, "is_ready_to_fire? "); lisp_print(car(p), stdout); printf("\n");
+		fprintf(model->out, "is_ready_to_fire? "); lisp_print(car(p), stdout); printf("\n");
 	}
 	// set the production's vars to value NIL
 	LISPTR vars = cadddr(p);
@@ -660,157 +1247,755 @@ static bool is_ready_to_fire(LISPTR p)
 	// match the left-hand-side against current model state
 	if (lhs_matches(cadr(p))) {
 		if (inner_trace) {
-			fprintf(model.out, " ... ready to fire!\n");
+			fprintf(model->out, " ... ready to fire!\n");
 		}
 		return true;
 	}
 	if (inner_trace) {
-		fprintf(model.out, " ... not ready.\n");
+		fprintf(model->out, " ... not ready.\n");
 	}
 	return false;
 } // is_ready_to_fire
 
 
-static void event_action_production_selected(isactr_event* evt)
+// index of a buffer in the matcher's tables, or -1 if the matcher doesn't track it
+static int buffer_index(LISPTR buffer)
 {
-	LISPTR pname = car(evt->chunk);
-	fprintf(model.out, "     %5.3f   %-22ls %s %ls\n",
-		model.time, L"PROCEDURAL", "PRODUCTION-SELECTED", string_text(symbol_name(pname)));
-
-	// queue up events for reading, querying or searching buffers in the LHS
-	LISPTR lhs = cadr(evt->chunk);
-	while (consp(lhs)) {
-		LISPTR condition = car(lhs);
-		LISPTR op = car(condition);
-		if (op == BUFFER_TEST) {
-			isactr_event* evt = isactr_schedule_event(model.time, PRIORITY_0, event_action_buffer_read_action);
-			evt->buffer = cadr(condition);
-		}
-		lhs = cdr(lhs);
-	} // while
-
-	// followed (later) by the firing event
-	isactr_event* evt2 = isactr_schedule_event(model.time+0.05, PRIORITY_0, event_action_production_fired);
-	evt2->chunk = evt->chunk;
-}
+	if (buffer == GOAL) {
+		return 0;
+	} else if (buffer == RETRIEVAL) {
+		return 1;
+	}
+	return -1;
+} // buffer_index
 
-static void schedule_firing(LISPTR p)
+static isactr_chunk* buffer_contents(int b)
 {
-	isactr_event* evt = isactr_schedule_event(model.time, PRIORITY_MAX, event_action_production_selected);
-	evt->chunk = p;
-}
+	return (b == 0) ? model->goal : model->retrieval;
+} // buffer_contents
 
-static void event_action_conflict_resolution(isactr_event* evt)
+static inline int lowest_bit(unsigned x)
 {
-	fprintf(model.out, "     %5.3f   %-22ls %s\n",
-		model.time, L"PROCEDURAL", "CONFLICT-RESOLUTION");
-	// look for a production that is ready to fire.
-	LISPTR plist = model.pm;
-	while (consp(plist)) {
-		LISPTR p = car(plist);
-		if (is_ready_to_fire(p)) {
-			schedule_firing(p);
-			return;
-		}
-		plist = cdr(plist);
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, x);
+	return (int)i;
+#else
+	return __builtin_ctz(x);
+#endif
+} // lowest_bit
+
+// make room for at least count+1 elements of the given size in *parray
+static bool grow_array(void** parray, int* pcapacity, int count, size_t size)
+{
+	if (count < *pcapacity) {
+		return true;
 	}
-}
+	int capacity = *pcapacity ? 2 * *pcapacity : 16;
+	void* p = realloc(*parray, capacity * size);
+	if (!p) {
+		return false;
+	}
+	*parray = p;
+	*pcapacity = capacity;
+	return true;
+} // grow_array
 
-// Create and enqueue an event at future time t with action act.
-// If successful, returns a pointer to the enqueued event.
-// Otherwise returns NULL after reporting error to 'err'.
-// Causes of failure:
-//	insufficient memory
-isactr_event* isactr_schedule_event(double t, double priority, isactr_event_action act)
+static void matcher_update_candidate(isactr_matcher* m, int i)
 {
-	assert(t >= model.time);
-	assert(act != NULL);
-
-	// allocate storage for event:
-	isactr_event* evt = (isactr_event*)malloc(sizeof isactr_event);
-	if (evt) {
-		evt->time = (float)t;
-		evt->action = act;
-		evt->priority = priority;
-		evt->buffer = NIL;
-		evt->chunk = NIL;
-		evt->requested = false;
-		// sort new event into the model's event queue
-		isactr_push_event(evt);
+	unsigned bit = 1u << (i % BITS_PER_WORD);
+	if (m->prods[i].alphaFailures == 0) {
+		m->candidates[i / BITS_PER_WORD] |= bit;
 	} else {
-		fprintf(model.err, "out of memory in isactr_schedule_event(t=%1.3f)\n", t);
+		m->candidates[i / BITS_PER_WORD] &= ~bit;
 	}
-	// return the newly created event for possible further customization by caller:
-	return evt;
-} // isactr_schedule_event
+} // matcher_update_candidate
 
-void isactr_release_event(isactr_event* evt)
+static void matcher_set_alpha(isactr_matcher* m, isactr_alpha_test* a, bool result)
 {
-	assert(evt != NULL);
-	assert(evt->action);
+	if (a->result == result) {
+		return;
+	}
+	a->result = result;
+	for (int j = 0; j < a->userCount; j++) {
+		int i = a->users[j];
+		m->prods[i].alphaFailures += result ? -1 : 1;
+		matcher_update_candidate(m, i);
+	}
+} // matcher_set_alpha
 
-	free(evt);
-}
+// hash consistent with eql, which is identity since equal numbers are the same LISPTR
+static unsigned value_hash(LISPTR x)
+{
+	unsigned h = (unsigned)((size_t)x ^ ((unsigned long long)(size_t)x >> 32));
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h;
+} // value_hash
+
+static unsigned slot_value_hash(LISPTR slotName, LISPTR value)
+{
+	return value_hash(value) * 31 + value_hash(slotName) * 7;
+} // slot_value_hash
 
-isactr_event* isactr_dequeue_next_event(isactr_model* model)
+static unsigned alpha_hash(int b, LISPTR modifier, LISPTR slotName, LISPTR value)
 {
-	isactr_event* evt = model->eventQueue.next;
-	if (evt) {
-		assert(evt->action);
-		model->eventQueue.next = evt->next;
+	return slot_value_hash(slotName, value) + value_hash(modifier) * 3 + b;
+} // alpha_hash
+
+// find the alpha test (buffer modifier slot value), -1 if there isn't one
+static int matcher_lookup_alpha(isactr_matcher* m, int b, LISPTR modifier, LISPTR slotName, LISPTR value)
+{
+	if (m->alphaIndexSize == 0) {
+		return -1;
 	}
-	return evt;
-}
+	unsigned mask = m->alphaIndexSize - 1;
+	for (unsigned h = alpha_hash(b, modifier, slotName, value) & mask; m->alphaIndex[h] >= 0; h = (h+1) & mask) {
+		isactr_alpha_test* a = &m->alphas[m->alphaIndex[h]];
+		if (a->buffer == b && a->modifier == modifier && a->slotName == slotName && eql(a->value, value)) {
+			return m->alphaIndex[h];
+		}
+	}
+	return -1;
+} // matcher_lookup_alpha
 
-bool isactr_do_next_event(void)
+static void matcher_index_alpha(isactr_matcher* m, int k)
 {
-	isactr_event* evt;
-	if (!(evt = isactr_dequeue_next_event(&model))) {
-		fprintf(model.out, "     %5.3f   ------                 %s\n",
-			model.time, "Stopped because no events left to process");
-		return false;							// event queue empty
+	isactr_alpha_test* a = &m->alphas[k];
+	unsigned mask = m->alphaIndexSize - 1;
+	unsigned h = alpha_hash(a->buffer, a->modifier, a->slotName, a->value) & mask;
+	while (m->alphaIndex[h] >= 0) {
+		h = (h+1) & mask;
+	}
+	m->alphaIndex[h] = k;
+} // matcher_index_alpha
+
+// make room in the alpha index for one more test, keeping it at most half full
+static bool matcher_grow_index(isactr_matcher* m)
+{
+	if (2 * (m->alphaCount+1) <= m->alphaIndexSize) {
+		return true;
 	}
-	if (evt->time > model.timeLimit) {
-		fprintf(model.out, "     %5.3f   ------                 %s\n",
-			model.time, "Stopped because time limit reached");
+	int size = m->alphaIndexSize ? 2 * m->alphaIndexSize : 64;
+	int* index = (int*)malloc(size * sizeof(int));
+	if (!index) {
 		return false;
 	}
-	model.time = evt->time;				// 'now' is the time of this event
-	evt->action(evt);						// 'do' the event
-	isactr_release_event(evt);
+	for (int h = 0; h < size; h++) {
+		index[h] = -1;
+	}
+	free(m->alphaIndex);
+	m->alphaIndex = index;
+	m->alphaIndexSize = size;
+	for (int k = 0; k < m->alphaCount; k++) {
+		matcher_index_alpha(m, k);
+	}
 	return true;
-}
+} // matcher_grow_index
 
-void isactr_model_init(void)
+// find or add the isactr_match_slot for buffer b slot slotName, -1 if out of memory
+static int matcher_find_slot(isactr_matcher* m, int b, LISPTR slotName)
+{
+	isactr_match_buffer* mb = &m->buffers[b];
+	for (int j = 0; j < mb->slotCount; j++) {
+		if (mb->slots[j].slotName == slotName) {
+			return j;
+		}
+	}
+	if (!grow_array((void**)&mb->slots, &mb->slotCapacity, mb->slotCount, sizeof(isactr_match_slot))) {
+		return -1;
+	}
+	isactr_match_slot* ms = &mb->slots[mb->slotCount];
+	memset(ms, 0, sizeof *ms);
+	ms->slotName = slotName;
+	ms->value = chunk_slot(buffer_contents(b), slotName);
+	ms->trueAlpha = -1;
+	return mb->slotCount++;
+} // matcher_find_slot
+
+static bool is_order_modifier(LISPTR modifier)
 {
-	memset(&model, 0, sizeof model);
-	model.running = false;
-	model.time = 0.0;
-	model.timeLimit = INFINITY;
-	model.eventQueue.next = NULL;
-	model.types = NIL;
-	model.dm = NIL;
-	model.pm = NIL;
-	model.goal = NIL;
-	model.retrieval = NIL;
+	return modifier == LT || modifier == LEQ || modifier == GT || modifier == GEQ;
 }
 
-
-void isactr_clear_event_queue(void)
+// index in ms->ordered of the first test of a number >= d (or > d if after)
+static int ordered_search(isactr_matcher* m, isactr_match_slot* ms, double d, bool after)
 {
-	isactr_event* evt;
-	while ((evt = isactr_dequeue_next_event(&model))) {
-		isactr_release_event(evt);
+	int lo = 0, hi = ms->orderedCount;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		double v = number_value(m->alphas[ms->ordered[mid]].value);
+		if (v < d || (after && v == d)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
-}
+	return lo;
+} // ordered_search
+
+// re-evaluate the tests tests[0..n-1] against contents
+static void matcher_retest(isactr_matcher* m, const int* tests, int n, isactr_chunk* contents)
+{
+	for (int j = 0; j < n; j++) {
+		isactr_alpha_test* a = &m->alphas[tests[j]];
+		matcher_set_alpha(m, a, slot_match(contents, a->modifier, a->slotName, a->value));
+	}
+} // matcher_retest
+
+// re-evaluate the test (buffer modifier slot value), if there is one
+static void matcher_retest_value(isactr_matcher* m, int b, LISPTR modifier, isactr_match_slot* ms, LISPTR value, isactr_chunk* contents)
+{
+	int k = matcher_lookup_alpha(m, b, modifier, ms->slotName, value);
+	if (k >= 0) {
+		matcher_retest(m, &k, 1, contents);
+	}
+} // matcher_retest_value
+
+// Called whenever the contents of a buffer change:
+// re-evaluate the alpha tests on that buffer, and mark matches against it out of date.
+static void matcher_buffer_changed(LISPTR buffer)
+{
+	isactr_matcher* m = &model->matcher;
+	int b = buffer_index(buffer);
+	if (b < 0) {
+		return;
+	}
+	m->version[b]++;
+	isactr_chunk* contents = buffer_contents(b);
+	isactr_match_buffer* mb = &m->buffers[b];
+	for (int j = 0; j < mb->slotCount; j++) {
+		isactr_match_slot* ms = &mb->slots[j];
+		LISPTR old = ms->value;
+		LISPTR value = chunk_slot(contents, ms->slotName);
+		if (value == old) {
+			continue;
+		}
+		ms->value = value;
+		// equality tests: only the test of the slot's new value can be true
+		int k = matcher_lookup_alpha(m, b, EQUALS, ms->slotName, value ? value : NIL);
+		if (k != ms->trueAlpha) {
+			if (ms->trueAlpha >= 0) {
+				matcher_set_alpha(m, &m->alphas[ms->trueAlpha], false);
+			}
+			if (k >= 0) {
+				matcher_set_alpha(m, &m->alphas[k], true);
+			}
+			ms->trueAlpha = k;
+		}
+		// - tests: only the tests of the old and new values flip, unless
+		// the slot has come or gone, which changes what they all mean
+		if (!old || !value) {
+			matcher_retest(m, ms->unequal, ms->unequalCount, contents);
+		} else {
+			matcher_retest_value(m, b, MINUS, ms, old, contents);
+			matcher_retest_value(m, b, MINUS, ms, value, contents);
+		}
+		// order tests: only the tests of numbers from the old value to the new can flip
+		if (old && value && numberp(old) && numberp(value)) {
+			double lo = number_value(old), hi = number_value(value);
+			if (hi < lo) {
+				double d = lo; lo = hi; hi = d;
+			}
+			int first = ordered_search(m, ms, lo, false);
+			int last = ordered_search(m, ms, hi, true);
+			matcher_retest(m, ms->ordered + first, last - first, contents);
+		} else {
+			matcher_retest(m, ms->ordered, ms->orderedCount, contents);
+		}
+		matcher_retest(m, ms->others, ms->otherCount, contents);
+	}
+} // matcher_buffer_changed
+
+// Add test k to the slot's list for its kind of test. Returns false if out of memory.
+static bool matcher_slot_add_test(isactr_matcher* m, isactr_match_slot* ms, int k)
+{
+	isactr_alpha_test* a = &m->alphas[k];
+	if (a->modifier == EQUALS) {
+		if (a->result) {
+			ms->trueAlpha = k;
+		}
+	} else if (a->modifier == MINUS) {
+		if (!grow_array((void**)&ms->unequal, &ms->unequalCapacity, ms->unequalCount, sizeof(int))) {
+			return false;
+		}
+		ms->unequal[ms->unequalCount++] = k;
+	} else if (is_order_modifier(a->modifier) && numberp(a->value)) {
+		if (!grow_array((void**)&ms->ordered, &ms->orderedCapacity, ms->orderedCount, sizeof(int))) {
+			return false;
+		}
+		// keep them sorted by number
+		int i = ordered_search(m, ms, number_value(a->value), true);
+		memmove(ms->ordered + i + 1, ms->ordered + i, (ms->orderedCount - i) * sizeof(int));
+		ms->ordered[i] = k;
+		ms->orderedCount++;
+	} else {
+		if (!grow_array((void**)&ms->others, &ms->otherCapacity, ms->otherCount, sizeof(int))) {
+			return false;
+		}
+		ms->others[ms->otherCount++] = k;
+	}
+	return true;
+} // matcher_slot_add_test
+
+// find the alpha test (buffer modifier slot value), creating it if need be.
+// Returns its index, or -1 if out of memory.
+static int matcher_find_alpha(isactr_matcher* m, int b, LISPTR modifier, LISPTR slotName, LISPTR value)
+{
+	int k = matcher_lookup_alpha(m, b, modifier, slotName, value);
+	if (k >= 0) {
+		return k;
+	}
+	int slot = matcher_find_slot(m, b, slotName);
+	if (slot < 0 || !matcher_grow_index(m) ||
+		!grow_array((void**)&m->alphas, &m->alphaCapacity, m->alphaCount, sizeof(isactr_alpha_test))) {
+		return -1;
+	}
+	k = m->alphaCount;
+	isactr_alpha_test* a = &m->alphas[k];
+	a->buffer = b;
+	a->modifier = modifier;
+	a->slotName = slotName;
+	a->value = value;
+	a->slot = slot;
+	a->result = slot_match(buffer_contents(b), modifier, slotName, value);
+	a->users = NULL;
+	a->userCount = 0;
+	a->userCapacity = 0;
+	if (!matcher_slot_add_test(m, &m->buffers[b].slots[slot], k)) {
+		return -1;
+	}
+	m->alphaCount++;
+	matcher_index_alpha(m, k);
+	return k;
+} // matcher_find_alpha
+
+// Add production p (name lhs rhs vars) to the matcher, after all the others.
+// Returns false if out of memory.
+static bool matcher_add_production(isactr_matcher* m, LISPTR p)
+{
+	if (!grow_array((void**)&m->prods, &m->prodCapacity, m->prodCount, sizeof(isactr_production))) {
+		return false;
+	}
+	if (m->prodCount == m->candidateWords * BITS_PER_WORD) {
+		unsigned* words = (unsigned*)realloc(m->candidates, (m->candidateWords+1) * sizeof(unsigned));
+		if (!words) {
+			return false;
+		}
+		words[m->candidateWords++] = 0;
+		m->candidates = words;
+	}
+	int i = m->prodCount;
+	isactr_production* prod = &m->prods[i];
+	prod->p = p;
+	prod->alphaFailures = 0;
+	prod->buffers = 0;
+	prod->ready = false;
+	prod->untracked = false;
+	for (int b = 0; b < MATCH_BUFFERS; b++) {
+		prod->seen[b] = m->version[b] - 1;
+	}
+	// the matcher only follows buffer tests on buffers it knows
+	LISPTR lhs = cadr(p);
+	while (consp(lhs)) {
+		LISPTR cond = car(lhs); lhs = cdr(lhs);
+		int b = buffer_index(cadr(cond));
+		if (car(cond) != BUFFER_TEST || b < 0) {
+			prod->untracked = true;
+		} else {
+			prod->buffers |= 1u << b;
+		}
+	}
+	if (prod->buffers == 0) {
+		prod->untracked = true;
+	}
+	if (!prod->untracked) {
+		// hook the production up to its alpha tests
+		lhs = cadr(p);
+		while (consp(lhs)) {
+			LISPTR cond = car(lhs); lhs = cdr(lhs);
+			int b = buffer_index(cadr(cond));
+			for (LISPTR tests = cddr(cond); consp(tests); tests = cdr(tests)) {
+				LISPTR test = car(tests);
+				LISPTR value = caddr(test);
+				if (consp(value)) {
+					continue;			// variable test, matched with the full LHS
+				}
+				int k = matcher_find_alpha(m, b, car(test), cadr(test), value);
+				if (k < 0) {
+					return false;
+				}
+				isactr_alpha_test* a = &m->alphas[k];
+				if (!grow_array((void**)&a->users, &a->userCapacity, a->userCount, sizeof(int))) {
+					return false;
+				}
+				a->users[a->userCount++] = i;
+				if (!a->result) {
+					prod->alphaFailures++;
+				}
+			}
+		}
+	}
+	m->prodCount++;
+	matcher_update_candidate(m, i);
+	return true;
+} // matcher_add_production
+
+// true if production i is ready to fire, re-matching its LHS only if
+// one of the buffers it tests has changed since it was last matched.
+static bool matcher_ready(isactr_matcher* m, int i)
+{
+	isactr_production* prod = &m->prods[i];
+	bool stale = prod->untracked;
+	for (int b = 0; b < MATCH_BUFFERS; b++) {
+		if ((prod->buffers & (1u << b)) && prod->seen[b] != m->version[b]) {
+			prod->seen[b] = m->version[b];
+			stale = true;
+		}
+	}
+	if (stale) {
+		prod->ready = is_ready_to_fire(prod->p);
+	}
+	return prod->ready;
+} // matcher_ready
+
+static void matcher_release(isactr_matcher* m)
+{
+	for (int k = 0; k < m->alphaCount; k++) {
+		free(m->alphas[k].users);
+	}
+	free(m->alphas);
+	for (int b = 0; b < MATCH_BUFFERS; b++) {
+		isactr_match_buffer* mb = &m->buffers[b];
+		for (int j = 0; j < mb->slotCount; j++) {
+			free(mb->slots[j].unequal);
+			free(mb->slots[j].ordered);
+			free(mb->slots[j].others);
+		}
+		free(mb->slots);
+	}
+	free(m->alphaIndex);
+	free(m->prods);
+	free(m->candidates);
+	memset(m, 0, sizeof *m);
+} // matcher_release
+
+
+static void event_action_production_selected(isactr_event* evt)
+{
+	LISPTR pname = car(evt->chunk);
+	fprintf(model->out, "     %5.3f   %-22s %s %s\n",
+		ticks_to_seconds(model->time), "PROCEDURAL", "PRODUCTION-SELECTED", string_text(symbol_name(pname)));
+
+	// queue up events for reading, querying or searching buffers in the LHS
+	LISPTR lhs = cadr(evt->chunk);
+	while (consp(lhs)) {
+		LISPTR condition = car(lhs);
+		LISPTR op = car(condition);
+		if (op == BUFFER_TEST) {
+			isactr_event* evt = isactr_schedule_event(model->time, PRIORITY_0, event_action_buffer_read_action);
+			evt->buffer = cadr(condition);
+		}
+		lhs = cdr(lhs);
+	} // while
+
+	// followed (later) by the firing event
+	isactr_event* evt2 = isactr_schedule_event(model->time+MS_TO_TICKS(50), PRIORITY_0, event_action_production_fired);
+	evt2->chunk = evt->chunk;
+}
+
+static void schedule_firing(LISPTR p)
+{
+	isactr_event* evt = isactr_schedule_event(model->time, PRIORITY_MAX, event_action_production_selected);
+	evt->chunk = p;
+}
+
+static void event_action_conflict_resolution(isactr_event* evt)
+{
+	fprintf(model->out, "     %5.3f   %-22s %s\n",
+		ticks_to_seconds(model->time), "PROCEDURAL", "CONFLICT-RESOLUTION");
+	// look for a production that is ready to fire,
+	// in PM order, among the candidates whose alpha tests all pass.
+	isactr_matcher* m = &model->matcher;
+	for (int w = 0; w < m->candidateWords; w++) {
+		unsigned bits = m->candidates[w];
+		while (bits) {
+			int i = w * BITS_PER_WORD + lowest_bit(bits);
+			bits &= bits - 1;
+			if (matcher_ready(m, i)) {
+				schedule_firing(m->prods[i].p);
+				return;
+			}
+		}
+	}
+}
+
+// Get storage for one event from the pool:
+// a released event if there is one, otherwise the next unused slot in the slabs.
+// Returns NULL if a new slab is needed and can't be allocated.
+static isactr_event* event_pool_alloc(isactr_event_pool* pool)
+{
+	isactr_event* evt = pool->freeList;
+	if (evt) {
+		pool->freeList = evt->next;
+	} else {
+		if (!pool->current || pool->used == EVENT_SLAB_SIZE) {
+			// move on to the next slab, allocating one if we've used them all
+			isactr_event_slab* slab = pool->current ? pool->current->next : pool->slabs;
+			if (!slab) {
+				slab = (isactr_event_slab*)malloc(sizeof(isactr_event_slab));
+				if (!slab) {
+					return NULL;
+				}
+				slab->next = NULL;
+				for (int i = 0; i < EVENT_SLAB_SIZE; i++) {
+					slab->events[i].generation = 0;
+				}
+				if (pool->current) {
+					pool->current->next = slab;
+				} else {
+					pool->slabs = slab;
+				}
+				pool->slabCount++;
+			}
+			pool->current = slab;
+			pool->used = 0;
+		}
+		evt = &pool->current->events[pool->used++];
+	}
+	// invalidate any handles to this record's previous use
+	evt->generation++;
+	if (++pool->live > pool->peakLive) {
+		pool->peakLive = pool->live;
+	}
+	return evt;
+} // event_pool_alloc
+
+static void event_pool_free(isactr_event_pool* pool, isactr_event* evt)
+{
+	evt->next = pool->freeList;
+	pool->freeList = evt;
+	pool->live--;
+} // event_pool_free
+
+// Return every event to the pool at once. The slabs are kept for reuse.
+static void event_pool_reset(isactr_event_pool* pool)
+{
+	pool->current = pool->slabs;
+	pool->used = 0;
+	pool->freeList = NULL;
+	pool->live = 0;
+} // event_pool_reset
+
+// Give the pool's slabs back to the system.
+static void event_pool_release(isactr_event_pool* pool)
+{
+	while (pool->slabs) {
+		isactr_event_slab* slab = pool->slabs;
+		pool->slabs = slab->next;
+		free(slab);
+	}
+	pool->current = NULL;
+	pool->used = 0;
+	pool->freeList = NULL;
+	pool->slabCount = 0;
+	pool->live = 0;
+} // event_pool_release
+
+// Create and enqueue an event at future time t with action act.
+// If successful, returns a pointer to the enqueued event.
+// Otherwise returns NULL after reporting error to 'err'.
+// Causes of failure:
+//	insufficient memory
+isactr_event* isactr_schedule_event(isactr_time t, double priority, isactr_event_action act)
+{
+	assert(t >= model->time);
+	assert(act != NULL);
+
+	// allocate storage for event:
+	isactr_event* evt = event_pool_alloc(&model->eventPool);
+	if (evt) {
+		evt->time = t;
+		evt->action = act;
+		evt->priority = priority;
+		evt->index = -1;
+		evt->cancelled = false;
+		evt->buffer = NIL;
+		evt->chunk = NIL;
+		evt->requested = false;
+		// sort new event into the model's event queue
+		if (!isactr_push_event(evt)) {
+			event_pool_free(&model->eventPool, evt);
+			evt = NULL;
+		}
+	}
+	if (!evt) {
+		fprintf(model->err, "out of memory in isactr_schedule_event(t=%1.3f)\n", ticks_to_seconds(t));
+	}
+	// return the newly created event for possible further customization by caller:
+	return evt;
+} // isactr_schedule_event
+
+void isactr_release_event(isactr_event* evt)
+{
+	assert(evt != NULL);
+	assert(evt->action);
+
+	event_pool_free(&model->eventPool, evt);
+}
+
+// The next event to happen, left in the queue. NULL if there are none.
+static isactr_event* isactr_peek_next_event(isactr_model* model)
+{
+	isactr_event_queue* q = &model->eventQueue;
+	while (q->count > 0 && q->heap[0]->cancelled) {
+		// discard cancelled event
+		isactr_release_event(heap_remove(q, 0));
+	}
+	return q->count > 0 ? q->heap[0] : NULL;
+}
+
+bool isactr_do_next_event(void)
+{
+	isactr_event* evt = isactr_peek_next_event(model);
+	if (!evt) {
+		fprintf(model->out, "     %5.3f   ------                 %s\n",
+			ticks_to_seconds(model->time), "Stopped because no events left to process");
+		return false;							// event queue empty
+	}
+	if (evt->time > model->timeLimit) {
+		// the event stays queued for the next run, which starts from here
+		model->time = model->timeLimit;
+		fprintf(model->out, "     %5.3f   ------                 %s\n",
+			ticks_to_seconds(model->time), "Stopped because time limit reached");
+		return false;
+	}
+	heap_remove(&model->eventQueue, 0);
+	model->time = evt->time;				// 'now' is the time of this event
+	evt->action(evt);						// 'do' the event
+	isactr_release_event(evt);
+	return true;
+}
+
+static void mark_chunk(isactr_chunk* chunk)
+{
+	if (chunk) {
+		for (int i = 0; i < chunk->slotCount; i++) {
+			if (chunk->values[i]) {
+				lisp_gc_mark(chunk->values[i]);
+			}
+		}
+	}
+}
+
+// Mark the Lisp data the model holds outside the Lisp heap.
+static void isactr_gc_mark(void)
+{
+	lisp_gc_mark(model->types);
+	lisp_gc_mark(model->dm);
+	lisp_gc_mark(model->pm);
+	for (int i = 0; i < model->dmIndex.chunkCount; i++) {
+		mark_chunk(model->dmIndex.chunks[i]);
+	}
+	mark_chunk(model->goal);
+	mark_chunk(model->retrieval);
+	// the matcher compares slot values with the ones it last saw, so those mustn't be reused
+	for (int b = 0; b < MATCH_BUFFERS; b++) {
+		for (int j = 0; j < model->matcher.buffers[b].slotCount; j++) {
+			lisp_gc_mark(model->matcher.buffers[b].slots[j].value);
+		}
+	}
+	for (int i = 0; i < model->eventQueue.count; i++) {
+		isactr_event* evt = model->eventQueue.heap[i];
+		lisp_gc_mark(evt->buffer);
+		lisp_gc_mark(evt->chunk);
+	}
+	checkpoints_gc_mark();
+}
+
+// Chunks are the only foreign objects in the Lisp heap.
+// In a heap image they are numbered by DM ordinal, followed by the buffers' own chunks.
+static uintptr_t chunk_image_index(LISPTR x)
+{
+	isactr_chunk* chunk = (isactr_chunk*)x;
+	if (chunk == model->goalStore.chunk) {
+		return model->dmIndex.chunkCount + 1;
+	}
+	if (chunk == model->retrievalStore.chunk) {
+		return model->dmIndex.chunkCount + 2;
+	}
+	return chunk->id + 1;
+}
+
+static LISPTR chunk_image_at(uintptr_t n)
+{
+	uintptr_t count = model->dmIndex.chunkCount;
+	if (n >= 1 && n <= count) {
+		return (LISPTR)model->dmIndex.chunks[n-1];
+	}
+	if (n == count + 1) {
+		return (LISPTR)model->goalStore.chunk;
+	}
+	if (n == count + 2) {
+		return (LISPTR)model->retrievalStore.chunk;
+	}
+	return NULL;
+}
+
+void isactr_model_init(void)
+{
+	memset(model, 0, sizeof *model);
+	model->running = false;
+	model->time = 0;
+	model->timeLimit = ISACTR_TIME_MAX;
+	model->eventQueue.heap = NULL;
+	model->eventQueue.count = 0;
+	model->eventQueue.capacity = 0;
+	model->eventQueue.seq = 0;
+	model->types = NIL;
+	model->dm = NIL;
+	model->pm = NIL;
+	model->pmLast = NIL;
+	model->goal = NULL;
+	model->retrieval = NULL;
+	lisp_gc_add_marker(isactr_gc_mark);
+	lisp_image_foreign(chunk_image_index, chunk_image_at);
+}
+
+
+// Empty the event queue, releasing every pending event.
+void isactr_clear_event_queue(void)
+{
+	model->eventQueue.count = 0;
+	event_pool_reset(&model->eventPool);
+}
 
 void isactr_model_release(void)
 {
 	// clear out the event queue if any:
 	isactr_clear_event_queue();
-	model.types = NIL;
-	model.dm = NIL;
-	model.pm = NIL;
+	free(model->eventQueue.heap);
+	model->eventQueue.heap = NULL;
+	model->eventQueue.capacity = 0;
+	event_pool_release(&model->eventPool);
+	model->types = NIL;
+	model->dm = NIL;
+	model->pm = NIL;
+	model->pmLast = NIL;
+	model->goal = NULL;
+	model->retrieval = NULL;
+	free(model->goalStore.chunk);
+	free(model->retrievalStore.chunk);
+	memset(&model->goalStore, 0, sizeof model->goalStore);
+	memset(&model->retrievalStore, 0, sizeof model->retrievalStore);
+	for (int i = 0; i < model->dmIndex.chunkCount; i++) {
+		free(model->dmIndex.chunks[i]);
+	}
+	dm_index_release(&model->dmIndex);
+	checkpoints_release();
+	release_chunk_types();
+	matcher_release(&model->matcher);
 }
 
 
@@ -824,97 +2009,271 @@ bool isactr_model_load(FILE* in, FILE* out, FILE* err)
 
 void isactr_model_run(double dDur)
 {
-	model.timeLimit = dDur;
-
+	isactr_time duration = seconds_to_ticks(dDur);
+	model->timeLimit = (duration < ISACTR_TIME_MAX - model->time) ? model->time + duration : ISACTR_TIME_MAX;
+
+	// What a run conses - copies of forms with their variables filled in -
+	// is garbage by the end, except what the events still pending refer
+	// to, so it comes from a region that is emptied in one go afterwards.
+	lisp_region_begin();
+	model->running = true;
 	while (isactr_do_next_event()) {}
-	isactr_clear_event_queue();
-	fprintf(model.out, "%0.1f\n47\n", model.time);
+	model->running = false;
+	if (model->eventQueue.count == 0) {
+		isactr_clear_event_queue();			// give back the event pool's slabs in one go
+	}
+	for (int i = 0; i < model->eventQueue.count; i++) {
+		isactr_event* evt = model->eventQueue.heap[i];
+		evt->chunk = lisp_region_keep(evt->chunk);
+	}
+	lisp_region_end();
+	if (inner_trace) {
+		fprintf(model->out, "--events: peak %d live, %d slabs of %d\n",
+			model->eventPool.peakLive, model->eventPool.slabCount, EVENT_SLAB_SIZE);
+		lisp_room(model->out);
+	}
+	fprintf(model->out, "%0.1f\n47\n", ticks_to_seconds(model->time));
+}
+
+// SplitMix64: the next number of the stream whose state is *state.
+static unsigned long long splitmix64(unsigned long long* state)
+{
+	unsigned long long z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+void isactr_model_seed(unsigned long long seed)
+{
+	model->random = seed;
+}
+
+double isactr_random(void)
+{
+	return (double)(splitmix64(&model->random) >> 11) * (1.0 / 9007199254740992.0);
 }
 
 
 void isactr_define_chunk_type(LISPTR ct)
 {
-	model.types = cons(ct, model.types);
+	// (chunk-type <name> {<slot>}*), where the name or a slot
+	// can be a list whose car is the name
+	LISPTR name = car(ct);
+	isactr_chunk_type* layout = find_chunk_type(consp(name) ? car(name) : name);
+	for (LISPTR p = cdr(ct); layout && consp(p); p = cdr(p)) {
+		LISPTR slotName = car(p);
+		if (chunk_type_add_slot(layout, consp(slotName) ? car(slotName) : slotName) < 0) {
+			layout = NULL;
+		}
+	}
+	if (!layout) {
+		fprintf(model->err, "out of memory in isactr_define_chunk_type\n");
+		return;
+	}
+	model->types = cons(ct, model->types);
 	if (inner_trace) {
-		fprintf(model.out, "CHUNK-TYPE: ");
-		lisp_print(ct, model.out);
-		fprintf(model.out, "\n");
+		fprintf(model->out, "CHUNK-TYPE: ");
+		lisp_print(ct, model->out);
+		fprintf(model->out, "\n");
 	}
 }
 
 
-void isactr_add_dm(LISPTR chunk)
+static isactr_posting* dm_lookup_posting(isactr_dm_index* ix, LISPTR slotName, LISPTR value)
+{
+	if (ix->tableSize == 0) {
+		return NULL;
+	}
+	unsigned mask = ix->tableSize - 1;
+	for (unsigned h = slot_value_hash(slotName, value) & mask; ix->table[h] >= 0; h = (h+1) & mask) {
+		isactr_posting* pl = &ix->postings[ix->table[h]];
+		if (pl->slotName == slotName && eql(pl->value, value)) {
+			return pl;
+		}
+	}
+	return NULL;
+} // dm_lookup_posting
+
+static void dm_index_posting(isactr_dm_index* ix, int n)
+{
+	isactr_posting* pl = &ix->postings[n];
+	unsigned mask = ix->tableSize - 1;
+	unsigned h = slot_value_hash(pl->slotName, pl->value) & mask;
+	while (ix->table[h] >= 0) {
+		h = (h+1) & mask;
+	}
+	ix->table[h] = n;
+} // dm_index_posting
+
+// find or create the posting list for (slotName value), NULL if out of memory
+static isactr_posting* dm_find_posting(isactr_dm_index* ix, LISPTR slotName, LISPTR value)
+{
+	isactr_posting* pl = dm_lookup_posting(ix, slotName, value);
+	if (pl) {
+		return pl;
+	}
+	if (2 * (ix->postingCount+1) > ix->tableSize) {
+		// keep the table at most half full
+		int size = ix->tableSize ? 2 * ix->tableSize : 256;
+		int* table = (int*)malloc(size * sizeof(int));
+		if (!table) {
+			return NULL;
+		}
+		for (int h = 0; h < size; h++) {
+			table[h] = -1;
+		}
+		free(ix->table);
+		ix->table = table;
+		ix->tableSize = size;
+		for (int n = 0; n < ix->postingCount; n++) {
+			dm_index_posting(ix, n);
+		}
+	}
+	if (!grow_array((void**)&ix->postings, &ix->postingCapacity, ix->postingCount, sizeof(isactr_posting))) {
+		return NULL;
+	}
+	pl = &ix->postings[ix->postingCount];
+	pl->slotName = slotName;
+	pl->value = value;
+	pl->chunks = NULL;
+	pl->count = 0;
+	pl->capacity = 0;
+	dm_index_posting(ix, ix->postingCount++);
+	return pl;
+} // dm_find_posting
+
+// Add chunk to the DM index. Returns false if out of memory.
+static bool dm_index_chunk(isactr_dm_index* ix, isactr_chunk* chunk)
+{
+	if (!grow_array((void**)&ix->chunks, &ix->chunkCapacity, ix->chunkCount, sizeof(isactr_chunk*))) {
+		return false;
+	}
+	int id = ix->chunkCount;
+	for (int i = 0; i < chunk->slotCount; i++) {
+		if (!chunk->values[i]) {
+			continue;
+		}
+		isactr_posting* pl = dm_find_posting(ix, chunk->type->slotNames[i], chunk->values[i]);
+		if (!pl) {
+			return false;
+		}
+		if (!grow_array((void**)&pl->chunks, &pl->capacity, pl->count, sizeof(int))) {
+			return false;
+		}
+		pl->chunks[pl->count++] = id;
+	}
+	chunk->id = id;
+	ix->chunks[ix->chunkCount++] = chunk;
+	return true;
+} // dm_index_chunk
+
+static void dm_index_release(isactr_dm_index* ix)
 {
-	model.dm = cons(chunk, model.dm);
+	for (int n = 0; n < ix->postingCount; n++) {
+		free(ix->postings[n].chunks);
+	}
+	free(ix->postings);
+	free(ix->table);
+	free(ix->chunks);
+	memset(ix, 0, sizeof *ix);
+} // dm_index_release
+
+void isactr_add_dm(LISPTR def)
+{
+	isactr_chunk* chunk = chunk_from_list(def);
+	if (!chunk || !dm_index_chunk(&model->dmIndex, chunk)) {
+		fprintf(model->err, "out of memory in isactr_add_dm\n");
+		return;
+	}
+	model->dm = cons((LISPTR)chunk, model->dm);
 	if (inner_trace) {
-		fprintf(model.out, "ADD-DM: ");
-		lisp_print(chunk, model.out);
-		fprintf(model.out, "\n");
+		fprintf(model->out, "ADD-DM: ");
+		lisp_print(def, model->out);
+		fprintf(model->out, "\n");
 	}
 }
 
 LISPTR isactr_get_chunk(LISPTR chunk_name)
 {
-	LISPTR dm = model.dm;
+	LISPTR dm = model->dm;
 	while (consp(dm)) {
-		LISPTR chunk = car(dm); dm = cdr(dm);
-		if (car(chunk)==chunk_name) {
-			return chunk;
+		isactr_chunk* chunk = (isactr_chunk*)car(dm); dm = cdr(dm);
+		if (chunk->name == chunk_name) {
+			return (LISPTR)chunk;
 		}
 	}
 	return NIL;
 }
 
-static bool chunk_matches_key(LISPTR chunk, LISPTR key)
+// true if chunk has every slot in key, with a value eql to the key's.
+// key is a list ({<slot> <value>}*), where a value can be a (var.val) pair.
+static bool chunk_matches_key(isactr_chunk* chunk, LISPTR key)
 {
-	chunk = cdr(chunk);		// skip over chunk-name
-	while (consp(key) && consp(chunk)) {
-		LISPTR slot = car(key);
+	while (consp(key)) {
 		LISPTR value = cadr(key);
 		if (consp(value)) {
 			value = cdr(value);
 		}
-		// search the chunk for matching slot
-		LISPTR c = chunk;
-		while (consp(c)) {
-			if (car(c) == slot) {
-				if (!eql(cadr(c), value)) {
-					return false;			// value mismatch, fail
-				}
-				break;						// value match, continue with key
-			}
-			c = cddr(c);
-		}
-		if (c == NIL) {
-			// key-slot not found in chunk
+		LISPTR slotVal = chunk_slot(chunk, car(key));
+		if (slotVal == NULL || !eql(slotVal, value)) {
 			return false;
 		}
-		// we just found the leading (slot value) of key, in chunk
-		if (slot == car(chunk)) {
-			// if we just matched the leading slot of the chunk
-			// only search the tail from now on:
-			chunk = cddr(chunk);
-		}
-		// continue with rest of key
 		key = cddr(key);
 	}
-	// true if found everything in key, false otherwise:
-	return (key == NIL);
+	return true;
 }
 
-// note, returned list includes name in CAR
+// Return the most recently added chunk in DM that matches key.
+// A chunk can only match if it contains every (slot value) of the key,
+// so the candidates are the chunks on the two shortest posting lists
+// of the key's pairs; each of those is then checked in full.
+// Returns the chunk (an isactr_chunk*), or NIL if none matches.
 LISPTR isactr_retrieve_chunk(LISPTR key)
 {
-	LISPTR dm = model.dm;
-	LISPTR chunk = NIL;
-	while (consp(dm)) {
-		if (chunk_matches_key(car(dm), key)) {
-			chunk = car(dm);
-			break;
+	isactr_dm_index* ix = &model->dmIndex;
+	isactr_posting* best = NULL;
+	isactr_posting* second = NULL;
+	for (LISPTR k = key; consp(k); k = cddr(k)) {
+		LISPTR value = cadr(k);
+		if (consp(value)) {
+			value = cdr(value);
+		}
+		isactr_posting* pl = dm_lookup_posting(ix, car(k), value);
+		if (!pl) {
+			return NIL;						// no chunk has this (slot value)
+		}
+		if (!best || pl->count < best->count) {
+			second = best;
+			best = pl;
+		} else if (!second || pl->count < second->count) {
+			second = pl;
 		}
-		dm = cdr(dm);
 	}
-	return chunk;
+	if (!best) {
+		// an empty key matches any chunk
+		return (ix->chunkCount > 0) ? (LISPTR)ix->chunks[ix->chunkCount-1] : NIL;
+	}
+	// walk the intersection of the two lists, newest first
+	int j = second ? second->count-1 : -1;
+	for (int i = best->count-1; i >= 0; i--) {
+		int id = best->chunks[i];
+		if (second) {
+			while (j >= 0 && second->chunks[j] > id) {
+				j--;
+			}
+			if (j < 0) {
+				break;
+			}
+			if (second->chunks[j] != id) {
+				continue;
+			}
+		}
+		if (chunk_matches_key(ix->chunks[id], key)) {
+			return (LISPTR)ix->chunks[id];
+		}
+	}
+	return NIL;
 } // isactr_retrieve_chunk
 
 // Add a production lhs ==> rhs with specified name, to production memory.
@@ -925,22 +2284,1159 @@ LISPTR isactr_retrieve_chunk(LISPTR key)
 void isactr_add_production(LISPTR name, LISPTR lhs, LISPTR rhs, LISPTR vars)
 {
 	LISPTR prod = cons(name, cons(lhs, cons(rhs, cons(vars, NIL))));
+	if (!matcher_add_production(&model->matcher, prod)) {
+		fprintf(model->err, "out of memory in isactr_add_production(%s)\n", string_text(symbol_name(name)));
+		return;
+	}
 	// append production to production memory, so productions are tested in order.
-	model.pm = nconc(model.pm, cons(prod, NIL));
+	LISPTR cell = cons(prod, NIL);
+	if (model->pm == NIL) {
+		model->pm = cell;
+	} else {
+		rplacd(model->pmLast, cell);
+	}
+	model->pmLast = cell;
 	if (inner_trace) {
-		fprintf(model.out, "PRODUCTION: %ls\n  LHS: ", string_text(symbol_name(name)));
-		lisp_print(lhs, model.out);
-		fprintf(model.out, "\n  RHS: "); lisp_print(rhs, model.out);
-		fprintf(model.out, "\n  VARS: "); lisp_print(vars, model.out);
-		fprintf(model.out, "\n");
+		fprintf(model->out, "PRODUCTION: %s\n  LHS: ", string_text(symbol_name(name)));
+		lisp_print(lhs, model->out);
+		fprintf(model->out, "\n  RHS: "); lisp_print(rhs, model->out);
+		fprintf(model->out, "\n  VARS: "); lisp_print(vars, model->out);
+		fprintf(model->out, "\n");
 	}
 }
 
 void isactr_set_goal_focus(LISPTR chunk_name)
 {
-	isactr_event* evt = isactr_schedule_event(model.time, PRIORITY_MAX, event_action_set_buffer_chunk);
+	isactr_event* evt = isactr_schedule_event(model->time, PRIORITY_MAX, event_action_set_buffer_chunk);
 	evt->buffer = intern(L"GOAL");
 	evt->chunk = isactr_get_chunk(chunk_name);
 	evt->requested = false;
 } // fn_goal_focus
 
+
+///////////////////////////////////////////////////////////////////////
+// model images
+//
+// A model image is the model's own state followed by a Lisp heap image.
+// Lisp data is saved as LISP_IMAGE_REFs. On loading, they stay in the
+// model's LISPTR fields until the heap has been loaded, and are then
+// turned back into pointers. The indexes and the matcher aren't saved:
+// they are rebuilt from what is.
+
+#define MODEL_IMAGE_VERSION 2
+
+static const char modelImageMagic[8] = { 'I', 'S', 'A', 'C', 'T', 'R', 'M', 'D' };
+
+// every event action, so events can be saved by number
+static const isactr_event_action eventActions[] = {
+	event_action_null,
+	event_action_buffer_read_action,
+	event_action_retrieval_failure,
+	event_action_set_buffer_chunk,
+	event_action_mod_buffer,
+	event_action_retrieved,
+	event_action_start_retrieval,
+	event_action_production_fired,
+	event_action_clear_buffer,
+	event_action_module_request,
+	event_action_production_selected,
+	event_action_conflict_resolution
+};
+#define EVENT_ACTION_COUNT ((int)(sizeof eventActions / sizeof eventActions[0]))
+
+// an event as saved, without its place in the queue
+typedef struct _isactr_saved_event {
+	isactr_time		time;
+	double			priority;
+	int				action;				// index in eventActions
+	int				requested;
+	LISPTR			buffer;
+	LISPTR			chunk;
+} isactr_saved_event;
+
+static bool image_write(FILE* out, const void* p, size_t n)
+{
+	return fwrite(p, 1, n, out) == n;
+}
+
+static bool image_read(FILE* in, void* p, size_t n)
+{
+	return fread(p, 1, n, in) == n;
+}
+
+static bool write_int(FILE* out, int n)
+{
+	return image_write(out, &n, sizeof n);
+}
+
+static bool read_int(FILE* in, int* pn)
+{
+	return image_read(in, pn, sizeof *pn);
+}
+
+static bool write_ref(FILE* out, LISPTR x)
+{
+	LISP_IMAGE_REF ref = lisp_image_ref(x);
+	return image_write(out, &ref, sizeof ref);
+}
+
+// read a reference into *px, where it stays until relocate()
+static bool read_ref(FILE* in, LISPTR* px)
+{
+	LISP_IMAGE_REF ref;
+	if (!image_read(in, &ref, sizeof ref)) {
+		return false;
+	}
+	*px = (LISPTR)ref;
+	return true;
+}
+
+static void relocate(LISPTR* px)
+{
+	*px = lisp_image_ptr((LISP_IMAGE_REF)*px);
+}
+
+static int chunk_type_number(isactr_chunk_type* ct)
+{
+	for (int i = 0; i < model->chunkTypeCount; i++) {
+		if (model->chunkTypes[i] == ct) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// a chunk is saved as its type, its slot count, name and values
+static bool write_chunk(FILE* out, isactr_chunk* chunk)
+{
+	bool ok = write_int(out, chunk_type_number(chunk->type)) &&
+			  write_int(out, chunk->slotCount) &&
+			  write_ref(out, chunk->name);
+	for (int i = 0; ok && i < chunk->slotCount; i++) {
+		ok = write_ref(out, chunk->values[i]);
+	}
+	return ok;
+}
+
+// Read a chunk saved by write_chunk into a new one, or into store's chunk
+// if store isn't NULL. Returns NULL if the image is bad or out of memory.
+static isactr_chunk* read_chunk(FILE* in, isactr_chunk_store* store)
+{
+	int type, slotCount;
+	if (!read_int(in, &type) || !read_int(in, &slotCount) ||
+		type < 0 || type >= model->chunkTypeCount ||
+		slotCount < 1 || slotCount > model->chunkTypes[type]->slotCount) {
+		return NULL;
+	}
+	isactr_chunk* chunk;
+	if (store) {
+		if (!reserve_chunk_store(store, slotCount)) {
+			return NULL;
+		}
+		chunk = store->chunk;
+		chunk->type = model->chunkTypes[type];
+		chunk->slotCount = slotCount;
+		chunk->id = -1;
+	} else {
+		chunk = make_chunk(NIL, model->chunkTypes[type]);
+		if (!chunk) {
+			return NULL;
+		}
+		chunk->slotCount = slotCount;
+	}
+	bool ok = read_ref(in, &chunk->name);
+	for (int i = 0; ok && i < slotCount; i++) {
+		ok = read_ref(in, &chunk->values[i]);
+	}
+	if (!ok && !store) {
+		free(chunk);
+	}
+	return ok ? chunk : NULL;
+} // read_chunk
+
+static void relocate_chunk(isactr_chunk* chunk)
+{
+	relocate(&chunk->name);
+	for (int i = 0; i < chunk->slotCount; i++) {
+		relocate(&chunk->values[i]);
+	}
+}
+
+static int compare_event_seq(const void* a, const void* b)
+{
+	unsigned long long s1 = (*(isactr_event* const*)a)->seq;
+	unsigned long long s2 = (*(isactr_event* const*)b)->seq;
+	return (s1 > s2) - (s1 < s2);
+}
+
+static int event_action_number(isactr_event_action action)
+{
+	for (int i = 0; i < EVENT_ACTION_COUNT; i++) {
+		if (eventActions[i] == action) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// The pending events, in the order they were scheduled, in a malloc'd
+// array. *pretrievalEvent is set to the position of the retrieval in
+// progress, if any, otherwise -1. NULL if out of memory, or if an
+// event's action isn't in eventActions.
+static isactr_saved_event* save_events(int* pcount, int* pretrievalEvent)
+{
+	isactr_event_queue* q = &model->eventQueue;
+	isactr_event** pending = (isactr_event**)malloc((q->count+1) * sizeof(isactr_event*));
+	isactr_saved_event* events = (isactr_saved_event*)malloc((q->count+1) * sizeof(isactr_saved_event));
+	int count = 0;
+	*pretrievalEvent = -1;
+	if (!pending || !events) {
+		free(pending);
+		free(events);
+		return NULL;
+	}
+	for (int i = 0; i < q->count; i++) {
+		if (!q->heap[i]->cancelled) {
+			pending[count++] = q->heap[i];
+		}
+	}
+	qsort(pending, count, sizeof(isactr_event*), compare_event_seq);
+	for (int i = 0; i < count; i++) {
+		isactr_event* evt = pending[i];
+		if (isactr_event_pending(model->retrievalEvent) && model->retrievalEvent.evt == evt) {
+			*pretrievalEvent = i;
+		}
+		events[i].time = evt->time;
+		events[i].priority = evt->priority;
+		events[i].action = event_action_number(evt->action);
+		events[i].requested = evt->requested;
+		events[i].buffer = evt->buffer;
+		events[i].chunk = evt->chunk;
+		if (events[i].action < 0) {
+			free(events);
+			events = NULL;
+			break;
+		}
+	}
+	free(pending);
+	*pcount = count;
+	return events;
+} // save_events
+
+// Schedule saved events again, in their original order.
+// Returns false if out of memory.
+static bool restore_events(const isactr_saved_event* events, int count, int retrievalEvent)
+{
+	for (int i = 0; i < count; i++) {
+		isactr_event* evt = isactr_schedule_event(events[i].time, events[i].priority, eventActions[events[i].action]);
+		if (!evt) {
+			return false;
+		}
+		evt->requested = events[i].requested != 0;
+		evt->buffer = events[i].buffer;
+		evt->chunk = events[i].chunk;
+		if (i == retrievalEvent) {
+			model->retrievalEvent = isactr_event_handle_of(evt);
+		}
+	}
+	return true;
+} // restore_events
+
+// Write the model and the Lisp heap to out.
+static bool save_image(FILE* out)
+{
+	lisp_gc();
+	int version = MODEL_IMAGE_VERSION;
+	bool ok = image_write(out, modelImageMagic, sizeof modelImageMagic) &&
+			  write_int(out, version) &&
+			  image_write(out, &model->time, sizeof model->time) &&
+			  image_write(out, &model->timeLimit, sizeof model->timeLimit) &&
+			  write_int(out, model->retrievalState) &&
+			  image_write(out, &model->random, sizeof model->random) &&
+			  image_write(out, &model->firings, sizeof model->firings);
+	// chunk-types
+	ok = ok && write_int(out, model->chunkTypeCount);
+	for (int i = 0; ok && i < model->chunkTypeCount; i++) {
+		isactr_chunk_type* ct = model->chunkTypes[i];
+		ok = write_ref(out, ct->name) && write_int(out, ct->slotCount);
+		for (int k = 0; ok && k < ct->slotCount; k++) {
+			ok = write_ref(out, ct->slotNames[k]);
+		}
+	}
+	// DM, then the buffers' own chunks
+	ok = ok && write_int(out, model->dmIndex.chunkCount);
+	for (int i = 0; ok && i < model->dmIndex.chunkCount; i++) {
+		ok = write_chunk(out, model->dmIndex.chunks[i]);
+	}
+	isactr_chunk_store* stores[2] = { &model->goalStore, &model->retrievalStore };
+	for (int s = 0; ok && s < 2; s++) {
+		ok = write_int(out, stores[s]->chunk != NULL) &&
+			 (!stores[s]->chunk || write_chunk(out, stores[s]->chunk));
+	}
+	ok = ok &&
+		 write_ref(out, model->types) &&
+		 write_ref(out, model->dm) &&
+		 write_ref(out, model->pm) &&
+		 write_ref(out, model->pmLast) &&
+		 write_ref(out, (LISPTR)model->goal) &&
+		 write_ref(out, (LISPTR)model->retrieval);
+	// pending events, in the order they were scheduled
+	int eventCount = 0;
+	int retrievalEvent = -1;
+	isactr_saved_event* events = save_events(&eventCount, &retrievalEvent);
+	ok = ok && events && write_int(out, eventCount);
+	for (int i = 0; ok && i < eventCount; i++) {
+		isactr_saved_event* e = &events[i];
+		ok = image_write(out, &e->time, sizeof e->time) &&
+			 image_write(out, &e->priority, sizeof e->priority) &&
+			 write_int(out, e->action) &&
+			 write_int(out, e->requested) &&
+			 write_ref(out, e->buffer) &&
+			 write_ref(out, e->chunk);
+	}
+	free(events);
+	return ok && write_int(out, retrievalEvent) && lisp_save_image(out);
+} // save_image
+
+// Save the model and the Lisp heap to a file.
+bool isactr_save_image(const char* path)
+{
+	FILE* out = fopen(path, "wb");
+	if (!out) {
+		fprintf(model->err, "can't create image %s\n", path);
+		return false;
+	}
+	bool ok = save_image(out);
+	if (fclose(out) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(model->err, "error writing image %s\n", path);
+	}
+	return ok;
+} // isactr_save_image
+
+// Replace the model and the Lisp heap with the image read from in.
+static bool load_image(FILE* in, const char* path)
+{
+	isactr_model_release();
+	char magic[sizeof modelImageMagic];
+	int version, state, count;
+	bool ok = image_read(in, magic, sizeof magic) &&
+			  memcmp(magic, modelImageMagic, sizeof magic) == 0 &&
+			  read_int(in, &version) && version == MODEL_IMAGE_VERSION &&
+			  image_read(in, &model->time, sizeof model->time) &&
+			  image_read(in, &model->timeLimit, sizeof model->timeLimit) &&
+			  read_int(in, &state) &&
+			  image_read(in, &model->random, sizeof model->random) &&
+			  image_read(in, &model->firings, sizeof model->firings);
+	model->retrievalState = (BufferState)state;
+	// chunk-types, with their names left as references
+	ok = ok && read_int(in, &count);
+	for (int i = 0; ok && i < count; i++) {
+		LISPTR name;
+		int slotCount;
+		ok = read_ref(in, &name) && read_int(in, &slotCount) && slotCount >= 1 &&
+			 grow_array((void**)&model->chunkTypes, &model->chunkTypeCapacity, model->chunkTypeCount, sizeof(isactr_chunk_type*));
+		isactr_chunk_type* ct = ok ? (isactr_chunk_type*)calloc(1, sizeof(isactr_chunk_type)) : NULL;
+		if (!ct) {
+			ok = false;
+			break;
+		}
+		model->chunkTypes[model->chunkTypeCount++] = ct;
+		ct->name = name;
+		ct->slotNames = (LISPTR*)malloc(slotCount * sizeof(LISPTR));
+		ct->slotCapacity = ct->slotCount = slotCount;
+		ok = ct->slotNames != NULL;
+		for (int k = 0; ok && k < slotCount; k++) {
+			ok = read_ref(in, &ct->slotNames[k]);
+		}
+	}
+	// DM goes straight into the index's chunk list, so that chunk_image_at can
+	// find the chunks while the heap is loaded. They're indexed afterwards.
+	isactr_dm_index* ix = &model->dmIndex;
+	ok = ok && read_int(in, &count);
+	for (int i = 0; ok && i < count; i++) {
+		isactr_chunk* chunk = NULL;
+		ok = grow_array((void**)&ix->chunks, &ix->chunkCapacity, ix->chunkCount, sizeof(isactr_chunk*)) &&
+			 (chunk = read_chunk(in, NULL)) != NULL;
+		if (ok) {
+			ix->chunks[ix->chunkCount++] = chunk;
+		}
+	}
+	isactr_chunk_store* stores[2] = { &model->goalStore, &model->retrievalStore };
+	for (int s = 0; ok && s < 2; s++) {
+		int present;
+		ok = read_int(in, &present) && (!present || read_chunk(in, stores[s]) != NULL);
+	}
+	LISPTR goal, retrieval;
+	ok = ok &&
+		 read_ref(in, &model->types) &&
+		 read_ref(in, &model->dm) &&
+		 read_ref(in, &model->pm) &&
+		 read_ref(in, &model->pmLast) &&
+		 read_ref(in, &goal) &&
+		 read_ref(in, &retrieval);
+	int eventCount = 0;
+	int retrievalEvent = -1;
+	ok = ok && read_int(in, &eventCount) && eventCount >= 0;
+	isactr_saved_event* events = ok ? (isactr_saved_event*)malloc((eventCount+1) * sizeof(isactr_saved_event)) : NULL;
+	ok = ok && events;
+	for (int i = 0; ok && i < eventCount; i++) {
+		isactr_saved_event* e = &events[i];
+		ok = image_read(in, &e->time, sizeof e->time) &&
+			 image_read(in, &e->priority, sizeof e->priority) &&
+			 read_int(in, &e->action) &&
+			 e->action >= 0 && e->action < EVENT_ACTION_COUNT &&
+			 read_int(in, &e->requested) &&
+			 read_ref(in, &e->buffer) &&
+			 read_ref(in, &e->chunk);
+	}
+	ok = ok && read_int(in, &retrievalEvent);
+	if (!ok) {
+		fprintf(model->err, "%s is not a model image for this build\n", path);
+	}
+	ok = ok && lisp_load_image(in);
+	if (!ok) {
+		free(events);
+		return false;
+	}
+
+	// now the references can be turned back into pointers
+	for (int i = 0; i < model->chunkTypeCount; i++) {
+		isactr_chunk_type* ct = model->chunkTypes[i];
+		relocate(&ct->name);
+		for (int k = 0; k < ct->slotCount; k++) {
+			relocate(&ct->slotNames[k]);
+		}
+		ct->indexSize = 8;
+		while (ct->indexSize < 2 * ct->slotCount) {
+			ct->indexSize *= 2;
+		}
+		ct->index = (int*)malloc(ct->indexSize * sizeof(int));
+		if (!ct->index) {
+			ok = false;
+			break;
+		}
+		for (int h = 0; h < ct->indexSize; h++) {
+			ct->index[h] = -1;
+		}
+		for (int k = 0; k < ct->slotCount; k++) {
+			chunk_type_index_slot(ct, k);
+		}
+	}
+	for (int i = 0; i < ix->chunkCount; i++) {
+		relocate_chunk(ix->chunks[i]);
+	}
+	for (int s = 0; s < 2; s++) {
+		if (stores[s]->chunk) {
+			relocate_chunk(stores[s]->chunk);
+		}
+	}
+	relocate(&model->types);
+	relocate(&model->dm);
+	relocate(&model->pm);
+	relocate(&model->pmLast);
+	relocate(&goal);
+	relocate(&retrieval);
+	model->goal = (isactr_chunk*)goal;
+	model->retrieval = (isactr_chunk*)retrieval;
+	for (int i = 0; i < eventCount; i++) {
+		relocate(&events[i].buffer);
+		relocate(&events[i].chunk);
+	}
+	// rebuild the DM index and the matcher
+	count = ix->chunkCount;
+	ix->chunkCount = 0;
+	for (int i = 0; ok && i < count; i++) {
+		ok = dm_index_chunk(ix, ix->chunks[i]);
+	}
+	for (LISPTR p = model->pm; ok && consp(p); p = cdr(p)) {
+		ok = matcher_add_production(&model->matcher, car(p));
+	}
+	if (ok) {
+		matcher_buffer_changed(GOAL);
+		matcher_buffer_changed(RETRIEVAL);
+	}
+	// and schedule the pending events again
+	ok = ok && restore_events(events, eventCount, retrievalEvent);
+	free(events);
+	if (!ok) {
+		fprintf(model->err, "out of memory loading image %s\n", path);
+	}
+	return ok;
+} // load_image
+
+// Replace the model and the Lisp heap with the ones saved in an image.
+// Only for a freshly created context: if loading fails, neither can be used.
+bool isactr_load_image(const char* path)
+{
+	FILE* in = fopen(path, "rb");
+	if (!in) {
+		fprintf(model->err, "can't open image %s\n", path);
+		return false;
+	}
+	bool ok = load_image(in, path);
+	fclose(in);
+	return ok;
+} // isactr_load_image
+
+///////////////////////////////////////////////////////////////////////
+// checkpoints
+
+// A checkpoint is a copy of the model's dynamic state, kept under a name
+// so a run can be restored to it. Only what a run changes is copied:
+// productions and chunk-types stay as they are. DM is only ever added
+// to, so a checkpoint just remembers how many chunks DM had: restoring
+// it drops any added since, and with them any checkpoint made since
+// that includes them. The buffers' own chunks are copied. Checkpoints
+// aren't saved in images.
+typedef struct _isactr_saved_state {
+	struct _isactr_saved_state*	next;
+	LISPTR			name;				// SYMBOL
+	isactr_time		time;
+	BufferState		retrievalState;
+	unsigned long long	random;
+	long long		firings;
+	int				dmCount;			// chunks in DM
+	LISPTR			dm;					// model->dm
+	isactr_chunk*	goal;				// a DM chunk, or NULL if goalOwn
+	isactr_chunk*	retrieval;			// a DM chunk, or NULL if retrievalOwn
+	bool			goalOwn;			// GOAL held its own chunk, copied to goalStore
+	bool			retrievalOwn;
+	isactr_chunk_store	goalStore;
+	isactr_chunk_store	retrievalStore;
+	isactr_saved_event*	events;			// pending events, in the order they were scheduled
+	int				eventCount;
+	int				retrievalEvent;		// position in events of the retrieval in progress, -1 if none
+} isactr_saved_state;
+
+static void checkpoint_free(isactr_saved_state* cp)
+{
+	free(cp->goalStore.chunk);
+	free(cp->retrievalStore.chunk);
+	free(cp->events);
+	free(cp);
+}
+
+// Remove the checkpoints for which test is true.
+static void checkpoints_remove(bool (*test)(isactr_saved_state*, const void*), const void* arg)
+{
+	isactr_saved_state** pcp = &model->checkpoints;
+	while (*pcp) {
+		isactr_saved_state* cp = *pcp;
+		if (test(cp, arg)) {
+			*pcp = cp->next;
+			checkpoint_free(cp);
+		} else {
+			pcp = &cp->next;
+		}
+	}
+}
+
+static bool checkpoint_named(isactr_saved_state* cp, const void* name)
+{
+	return cp->name == (LISPTR)name;
+}
+
+static bool checkpoint_past_dm(isactr_saved_state* cp, const void* count)
+{
+	return cp->dmCount > *(const int*)count;
+}
+
+static bool checkpoint_any(isactr_saved_state*, const void*)
+{
+	return true;
+}
+
+static void checkpoints_release(void)
+{
+	checkpoints_remove(checkpoint_any, NULL);
+}
+
+static void checkpoints_gc_mark(void)
+{
+	for (isactr_saved_state* cp = model->checkpoints; cp; cp = cp->next) {
+		lisp_gc_mark(cp->dm);
+		mark_chunk(cp->goalStore.chunk);
+		mark_chunk(cp->retrievalStore.chunk);
+		for (int i = 0; i < cp->eventCount; i++) {
+			lisp_gc_mark(cp->events[i].buffer);
+			lisp_gc_mark(cp->events[i].chunk);
+		}
+	}
+}
+
+// Copy the chunk in a buffer, if it's the buffer's own, into a checkpoint's store.
+static bool checkpoint_buffer(isactr_chunk* chunk, isactr_chunk_store* own, isactr_chunk_store* store, isactr_chunk** pchunk, bool* powned)
+{
+	*powned = chunk && chunk == own->chunk;
+	*pchunk = *powned ? NULL : chunk;
+	return !*powned || copy_chunk_to_store(store, chunk, chunk->type);
+}
+
+// Drop the chunks added to DM after the first count.
+static void dm_truncate(isactr_dm_index* ix, int count)
+{
+	if (count == ix->chunkCount) {
+		return;
+	}
+	for (int i = count; i < ix->chunkCount; i++) {
+		free(ix->chunks[i]);
+	}
+	ix->chunkCount = count;
+	for (int n = 0; n < ix->postingCount; n++) {
+		isactr_posting* pl = &ix->postings[n];
+		while (pl->count > 0 && pl->chunks[pl->count-1] >= count) {
+			pl->count--;
+		}
+	}
+	checkpoints_remove(checkpoint_past_dm, &count);
+} // dm_truncate
+
+// Save the model's state as checkpoint name, replacing any checkpoint of that name.
+bool isactr_checkpoint(LISPTR name)
+{
+	isactr_saved_state* cp = (isactr_saved_state*)calloc(1, sizeof(isactr_saved_state));
+	bool ok = cp != NULL;
+	if (ok) {
+		cp->name = name;
+		cp->time = model->time;
+		cp->retrievalState = model->retrievalState;
+		cp->random = model->random;
+		cp->firings = model->firings;
+		cp->dmCount = model->dmIndex.chunkCount;
+		cp->dm = model->dm;
+		cp->events = save_events(&cp->eventCount, &cp->retrievalEvent);
+		ok = cp->events &&
+			 checkpoint_buffer(model->goal, &model->goalStore, &cp->goalStore, &cp->goal, &cp->goalOwn) &&
+			 checkpoint_buffer(model->retrieval, &model->retrievalStore, &cp->retrievalStore, &cp->retrieval, &cp->retrievalOwn);
+	}
+	if (!ok) {
+		if (cp) {
+			checkpoint_free(cp);
+		}
+		fprintf(model->err, "out of memory in isactr_checkpoint\n");
+		return false;
+	}
+	checkpoints_remove(checkpoint_named, name);
+	cp->next = model->checkpoints;
+	model->checkpoints = cp;
+	return true;
+} // isactr_checkpoint
+
+// Put the model back in the state saved as checkpoint name.
+// Not while the model is running.
+bool isactr_restore(LISPTR name)
+{
+	isactr_saved_state* cp = model->checkpoints;
+	while (cp && cp->name != name) {
+		cp = cp->next;
+	}
+	if (!cp) {
+		fprintf(model->err, "no checkpoint %s\n", string_text(symbol_name(name)));
+		return false;
+	}
+	if (model->running) {
+		fprintf(model->err, "can't restore checkpoint %s while the model is running\n", string_text(symbol_name(name)));
+		return false;
+	}
+	dm_truncate(&model->dmIndex, cp->dmCount);
+	model->dm = cp->dm;
+	model->time = cp->time;
+	model->retrievalState = cp->retrievalState;
+	model->random = cp->random;
+	model->firings = cp->firings;
+	model->goal = cp->goal;
+	model->retrieval = cp->retrieval;
+	bool ok = true;
+	if (cp->goalOwn) {
+		ok = copy_chunk_to_store(&model->goalStore, cp->goalStore.chunk, cp->goalStore.chunk->type);
+		model->goal = model->goalStore.chunk;
+	}
+	if (ok && cp->retrievalOwn) {
+		ok = copy_chunk_to_store(&model->retrievalStore, cp->retrievalStore.chunk, cp->retrievalStore.chunk->type);
+		model->retrieval = model->retrievalStore.chunk;
+	}
+	isactr_clear_event_queue();
+	model->retrievalEvent = isactr_event_handle_of(NULL);
+	ok = ok && restore_events(cp->events, cp->eventCount, cp->retrievalEvent);
+	matcher_buffer_changed(GOAL);
+	matcher_buffer_changed(RETRIEVAL);
+	if (!ok) {
+		fprintf(model->err, "out of memory in isactr_restore\n");
+	}
+	return ok;
+} // isactr_restore
+
+///////////////////////////////////////////////////////////////////////
+// contexts
+
+struct _isactr_context {
+	LISP_STATE*		lisp;
+	isactr_model	model;
+};
+
+static LISP_THREAD isactr_context* currentContext;
+
+isactr_context* isactr_context_create(FILE* in, FILE* out, FILE* err)
+{
+	isactr_context* cx = (isactr_context*)calloc(1, sizeof(isactr_context));
+	if (!cx) {
+		return NULL;
+	}
+	currentContext = cx;
+	model = &cx->model;
+	lisp_init();
+	cx->lisp = lisp_current();
+	init_standard_symbols();
+	isactr_model_init();
+	init_lisp_actr();
+	model->in = in;
+	model->out = out;
+	model->err = err;
+	return cx;
+} // isactr_context_create
+
+void isactr_context_switch(isactr_context* cx)
+{
+	if (cx == currentContext) {
+		return;
+	}
+	currentContext = cx;
+	model = cx ? &cx->model : NULL;
+	lisp_switch(cx ? cx->lisp : NULL);
+	if (cx) {
+		init_standard_symbols();		// finds the ones this Lisp already has
+	}
+} // isactr_context_switch
+
+isactr_context* isactr_context_current(void)
+{
+	return currentContext;
+}
+
+void isactr_context_destroy(isactr_context* cx)
+{
+	if (!cx) {
+		return;
+	}
+	isactr_context* previous = (cx == currentContext) ? NULL : currentContext;
+	isactr_context_switch(cx);
+	isactr_model_release();
+	lisp_shutdown();
+	free(cx);
+	currentContext = NULL;
+	model = NULL;
+	isactr_context_switch(previous);
+} // isactr_context_destroy
+
+///////////////////////////////////////////////////////////////////////
+// batch runs
+
+// The seed of replication r's random stream. Mixing r before it's
+// combined with seed keeps the streams of neighbouring replications
+// from overlapping.
+static unsigned long long replication_seed(unsigned long long seed, int r)
+{
+	unsigned long long x = (unsigned long long)r;
+	x = seed ^ splitmix64(&x);
+	return splitmix64(&x);
+}
+
+// A batch's replications are shared out among a pool of threads, each
+// with a context of its own that is loaded once from an image of the
+// model and put back to a checkpoint of it before every replication.
+// A worker takes replications from the front of its own range of them,
+// and when that's empty steals the back half of another's. A range is
+// packed into one word, next << 32 | end, so that taking and stealing
+// are each a single compare-and-swap.
+#define BATCH_RANGE(next, end)	(((unsigned long long)(next) << 32) | (unsigned)(end))
+
+// The words the threads of a batch share are only read and changed
+// through these, which use the compiler's own interlocked operations
+// (VS2010 has no <atomic>).
+// Set *p to val if it is old, and return what it was
+static unsigned long long batch_compare_swap(volatile unsigned long long* p, unsigned long long old, unsigned long long val)
+{
+#ifdef _MSC_VER
+	return (unsigned long long)_InterlockedCompareExchange64((volatile long long*)p, (long long)val, (long long)old);
+#else
+	__atomic_compare_exchange_n(p, &old, val, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return old;
+#endif
+}
+
+static unsigned long long batch_load(volatile unsigned long long* p)
+{
+	return batch_compare_swap(p, 0, 0);
+}
+
+static void batch_store(volatile unsigned long long* p, unsigned long long val)
+{
+	unsigned long long old = batch_load(p);
+	unsigned long long seen;
+	while ((seen = batch_compare_swap(p, old, val)) != old) {
+		old = seen;
+	}
+}
+
+struct batch;
+
+typedef struct {
+	struct batch*		b;
+	int					index;
+	isactr_context*		cx;
+	FILE*				sink;			// replications don't trace
+	volatile unsigned long long	range;
+#ifdef _MSC_VER
+	HANDLE				thread;
+#else
+	pthread_t			thread;
+#endif
+} batch_worker;
+
+typedef struct batch {
+	batch_worker*		workers;
+	int					workerCount;
+	int					first;
+	double				duration;
+	unsigned long long	seed;
+	isactr_run_result*	results;
+	volatile unsigned long long	failed;		// set once any worker fails
+} batch;
+
+// The next replication for worker w to run, -1 when there are none left.
+static int batch_take(batch* b, int w)
+{
+	volatile unsigned long long* own = &b->workers[w].range;
+	unsigned long long r = batch_load(own);
+	unsigned long long seen;
+	while ((unsigned)(r >> 32) < (unsigned)r) {
+		if ((seen = batch_compare_swap(own, r, r + (1ull << 32))) == r) {
+			return (int)(r >> 32);
+		}
+		r = seen;
+	}
+	for (int i = 1; i < b->workerCount; i++) {
+		volatile unsigned long long* other = &b->workers[(w + i) % b->workerCount].range;
+		r = batch_load(other);
+		while ((unsigned)(r >> 32) < (unsigned)r) {
+			unsigned next = (unsigned)(r >> 32), end = (unsigned)r;
+			unsigned from = end - (end - next + 1) / 2;
+			if ((seen = batch_compare_swap(other, r, BATCH_RANGE(next, from))) == r) {
+				// own is empty, so no one else changes it
+				batch_store(own, BATCH_RANGE(from + 1, end));
+				return (int)from;
+			}
+			r = seen;
+		}
+	}
+	return -1;
+} // batch_take
+
+// A worker thread of a batch run
+static void batch_work(batch* b, int w)
+{
+	int base;
+	lisp_gc_stack_base(&base);
+	isactr_context_switch(b->workers[w].cx);
+	LISPTR start = intern(L"BATCH-START");
+	int r;
+	while (!batch_load(&b->failed) && (r = batch_take(b, w)) >= 0) {
+		if (!isactr_restore(start)) {
+			batch_store(&b->failed, 1);
+			break;
+		}
+		isactr_model_seed(replication_seed(b->seed, b->first + r));
+		long long firings = model->firings;
+		isactr_model_run(b->duration);
+		b->results[r].replication = b->first + r;
+		b->results[r].time = ticks_to_seconds(model->time);
+		b->results[r].firings = model->firings - firings;
+	}
+	isactr_context_switch(NULL);
+} // batch_work
+
+#ifdef _MSC_VER
+static unsigned __stdcall batch_thread(void* arg)
+{
+	batch_worker* worker = (batch_worker*)arg;
+	batch_work(worker->b, worker->index);
+	return 0;
+}
+
+static bool batch_thread_start(batch_worker* worker)
+{
+	worker->thread = (HANDLE)_beginthreadex(NULL, 0, batch_thread, worker, 0, NULL);
+	return worker->thread != NULL;
+}
+
+static void batch_thread_join(batch_worker* worker)
+{
+	WaitForSingleObject(worker->thread, INFINITE);
+	CloseHandle(worker->thread);
+}
+
+static int processor_count(void)
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (int)si.dwNumberOfProcessors;
+}
+#else
+static void* batch_thread(void* arg)
+{
+	batch_worker* worker = (batch_worker*)arg;
+	batch_work(worker->b, worker->index);
+	return NULL;
+}
+
+static bool batch_thread_start(batch_worker* worker)
+{
+	return pthread_create(&worker->thread, NULL, batch_thread, worker) == 0;
+}
+
+static void batch_thread_join(batch_worker* worker)
+{
+	pthread_join(worker->thread, NULL);
+}
+
+static int processor_count(void)
+{
+	return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+#endif
+
+bool isactr_batch_run(int first, int count, double duration, unsigned long long seed, isactr_run_result* results)
+{
+	if (count <= 0) {
+		return true;
+	}
+	isactr_context* home = currentContext;
+	FILE* err = model->err;
+	int n = processor_count();
+	n = (n < 1) ? 1 : (n > count) ? count : n;
+	batch b;
+	b.workers = (batch_worker*)calloc(n, sizeof(batch_worker));
+	b.workerCount = n;
+	b.first = first;
+	b.duration = duration;
+	b.seed = seed;
+	b.results = results;
+	b.failed = 0;
+	FILE* image = tmpfile();
+	bool ok = b.workers && image && save_image(image);
+	if (!ok) {
+		fprintf(err, "can't save the model for a batch run\n");
+	}
+	// load each worker's context here, so the image is only read on one thread
+	for (int w = 0; b.workers && w < n; w++) {
+		batch_worker* worker = &b.workers[w];
+		worker->b = &b;
+		worker->index = w;
+		worker->cx = NULL;
+		worker->sink = ok ? fopen(NULL_DEVICE, "w") : NULL;
+		worker->range = BATCH_RANGE((long long)count * w / n, (long long)count * (w+1) / n);
+		if (worker->sink) {
+			worker->cx = isactr_context_create(NULL, worker->sink, err);
+		}
+		rewind(image);
+		ok = ok && worker->cx && load_image(image, "(batch)") && isactr_checkpoint(intern(L"BATCH-START"));
+	}
+	isactr_context_switch(NULL);
+	int started = 0;
+	if (ok) {
+		// a thread that can't be started leaves its range for the others to steal
+		while (started < n && batch_thread_start(&b.workers[started])) {
+			started++;
+		}
+		if (started == 0) {
+			fprintf(err, "can't start a thread for a batch run\n");
+			ok = false;
+		}
+	}
+	for (int i = 0; i < started; i++) {
+		batch_thread_join(&b.workers[i]);
+	}
+	for (int w = 0; b.workers && w < n; w++) {
+		isactr_context_destroy(b.workers[w].cx);
+		if (b.workers[w].sink) {
+			fclose(b.workers[w].sink);
+		}
+	}
+	isactr_context_switch(home);
+	if (image) {
+		fclose(image);
+	}
+	free(b.workers);
+	return ok && !b.failed;
+} // isactr_batch_run
+
+// Run one replication of the current model in a child process, which
+// sends its result down the pipe fds and exits.
+#ifndef _MSC_VER
+static pid_t fork_replication(int r, double duration, unsigned long long seed, const int fds[2])
+{
+	fflush(NULL);			// or the child would write out the parent's buffers too
+	pid_t pid = fork();
+	if (pid != 0) {
+		return pid;
+	}
+	close(fds[0]);
+	int fd = fds[1];
+	isactr_run_result result;
+	FILE* sink = fopen(NULL_DEVICE, "w");
+	if (sink) {
+		model->out = sink;
+	}
+	isactr_model_seed(replication_seed(seed, r));
+	long long firings = model->firings;
+	isactr_model_run(duration);
+	result.replication = r;
+	result.time = ticks_to_seconds(model->time);
+	result.firings = model->firings - firings;
+	// a write this small to a pipe is atomic, whatever the other children do
+	_exit(write(fd, &result, sizeof result) == (ssize_t)sizeof result ? EXIT_SUCCESS : EXIT_FAILURE);
+} // fork_replication
+
+typedef struct {
+	pid_t		pid;
+	int			replication;
+} batch_child;
+
+// Wait for child i, which has exited or is about to, and drop it from
+// the ones running. False if it failed.
+static bool reap_child(batch_child* children, int* live, int i, int options)
+{
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(children[i].pid, &status, options)) < 0 && errno == EINTR) {}
+	if (pid == 0) {
+		return true;			// still running
+	}
+	children[i] = children[--*live];
+	return pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+#endif
+
+bool isactr_fork_batch_run(int count, int workers, double duration, unsigned long long seed, isactr_run_result* results)
+{
+#ifdef _MSC_VER
+	(void)workers;
+	return isactr_batch_run(0, count, duration, seed, results);
+#else
+	int fds[2];
+	if (pipe(fds) != 0) {
+		fprintf(model->err, "can't create a pipe for a batch run\n");
+		return false;
+	}
+	if (workers < 1) {
+		workers = 1;
+	}
+	batch_child* children = (batch_child*)malloc(workers * sizeof(batch_child));	// the ones running, the host may have others
+	if (!children) {
+		fprintf(model->err, "out of memory for a batch run\n");
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	// Results are read as they come, not once their child is waited for:
+	// many children can finish at once, and one left writing to a full
+	// pipe would never exit.
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	lisp_gc();				// once, rather than in every child
+	bool ok = true;
+	int next = 0;			// next replication to start
+	int live = 0;			// children running
+	int done = 0;			// results read
+	while (next < count || live > 0) {
+		if (ok && next < count && live < workers) {
+			pid_t pid = fork_replication(next, duration, seed, fds);
+			if (pid < 0) {
+				fprintf(model->err, "can't start replication %d\n", next);
+				ok = false;
+			} else {
+				children[live].pid = pid;
+				children[live].replication = next;
+				live++;
+				next++;
+			}
+			continue;
+		}
+		if (live == 0) {
+			break;
+		}
+		bool progress = false;
+		isactr_run_result result;
+		ssize_t n;
+		while ((n = read(fds[0], &result, sizeof result)) == (ssize_t)sizeof result) {
+			progress = true;
+			if (result.replication < 0 || result.replication >= count) {
+				ok = false;
+				continue;
+			}
+			results[result.replication] = result;
+			done++;
+			// its child has sent its result, so it's on its way out
+			for (int i = 0; i < live; i++) {
+				if (children[i].replication == result.replication) {
+					ok = reap_child(children, &live, i, 0) && ok;
+					break;
+				}
+			}
+		}
+		if (n >= 0 || (errno != EAGAIN && errno != EINTR)) {
+			ok = false;				// a short read, or no pipe
+			break;
+		}
+		// one that exits without a result has failed
+		for (int i = live - 1; i >= 0; i--) {
+			int before = live;
+			ok = reap_child(children, &live, i, WNOHANG) && ok;
+			progress = progress || live < before;
+		}
+		if (!progress) {
+			struct pollfd pfd = { fds[0], POLLIN, 0 };
+			poll(&pfd, 1, 100);
+		}
+	}
+	if (ok) {
+		// results from children that had exited when last looked for
+		isactr_run_result result;
+		while (read(fds[0], &result, sizeof result) == (ssize_t)sizeof result &&
+			result.replication >= 0 && result.replication < count) {
+			results[result.replication] = result;
+			done++;
+		}
+	}
+	if (!ok || done != count) {
+		fprintf(model->err, "a replication failed\n");
+		ok = false;
+	}
+	close(fds[0]);
+	close(fds[1]);
+	// after a failure, don't leave any still running as zombies; with
+	// the pipe closed, one blocked writing to it gives up
+	for (int i = 0; i < live; i++) {
+		waitpid(children[i].pid, NULL, 0);
+	}
+	free(children);
+	return ok;
+#endif
+} // isactr_fork_batch_run
+
+void isactr_print_results(FILE* out, const isactr_run_result* results, int count)
+{
+	double time = 0, firings = 0;
+	fprintf(out, ";; replication  time  firings\n");
+	for (int i = 0; i < count; i++) {
+		fprintf(out, "%d %0.3f %lld\n", results[i].replication, results[i].time, results[i].firings);
+		time += results[i].time;
+		firings += (double)results[i].firings;
+	}
+	if (count > 0) {
+		fprintf(out, ";; %d replications: mean time %0.3f, mean firings %0.2f\n",
+			count, time / count, firings / count);
+	}
+} // isactr_print_results
@@ -11,22 +11,85 @@ const float PRIORITY_MIN = (float)log(0.0);
 #define PRIORITY_90		 90
 #define PRIORITY_100	100
 
-extern LISPTR GOAL, RETRIEVAL;
-extern LISPTR SGP, CHUNK_TYPE, ADD_DM, P, GOAL_FOCUS, RIGHT_ARROW;
-extern LISPTR EQUALS, MINUS, NOT, LT, LEQ, GT, GEQ;
-extern LISPTR BUFFER_TEST;
-extern LISPTR BUFFER_QUERY;
-extern LISPTR MOD_BUFFER_CHUNK;
-extern LISPTR MODULE_REQUEST;
-extern LISPTR CLEAR_BUFFER;
-extern LISPTR BANG_OUTPUT;
-extern LISPTR BANG_EVAL, BANG_SAFE_EVAL;
-extern LISPTR BANG_BIND, BANG_SAFE_BIND, BANG_MV_BIND;
+extern LISP_THREAD LISPTR GOAL, RETRIEVAL;
+extern LISP_THREAD LISPTR ISA;
+extern LISP_THREAD LISPTR SGP, CHUNK_TYPE, ADD_DM, P, GOAL_FOCUS, RIGHT_ARROW;
+extern LISP_THREAD LISPTR EQUALS, MINUS, NOT, LT, LEQ, GT, GEQ;
+extern LISP_THREAD LISPTR BUFFER_TEST;
+extern LISP_THREAD LISPTR BUFFER_QUERY;
+extern LISP_THREAD LISPTR MOD_BUFFER_CHUNK;
+extern LISP_THREAD LISPTR MODULE_REQUEST;
+extern LISP_THREAD LISPTR CLEAR_BUFFER;
+extern LISP_THREAD LISPTR BANG_OUTPUT;
+extern LISP_THREAD LISPTR BANG_EVAL, BANG_SAFE_EVAL;
+extern LISP_THREAD LISPTR BANG_BIND, BANG_SAFE_BIND, BANG_MV_BIND;
+
+// Contexts.
+// A context is one model with its own Lisp heap and symbols. Any number
+// can be created. Each thread has a current context, which the isactr_
+// and lisp_ functions work on, so models in different contexts can run
+// on different threads at once; a context must be current on only one
+// thread at a time. Switch only at top level, not from inside Lisp or a
+// running model. A thread must call lisp_gc_stack_base before it creates
+// a context or makes one current.
+typedef struct _isactr_context isactr_context;
+// Create a context reading from in, and make it current. NULL if out of memory.
+isactr_context* isactr_context_create(FILE* in, FILE* out, FILE* err);
+// Make cx current on this thread, or none if cx is NULL.
+void isactr_context_switch(isactr_context* cx);
+isactr_context* isactr_context_current(void);
+// Release everything cx owns. The current context stays current unless it's cx.
+void isactr_context_destroy(isactr_context* cx);
 
 void isactr_model_init(void);
+void isactr_model_seed(unsigned long long seed);
+double isactr_random(void);		// next of the model's random stream, in [0,1)
 void isactr_model_release(void);
 bool isactr_model_load(FILE* in, FILE* out, FILE* err);
-void isactr_model_run(double dDur);
+void isactr_model_run(double dDur);		// for dDur seconds from the current time
+
+// Save the model and Lisp heap to an image file, or replace them with
+// the ones in an image saved by the same build.
+bool isactr_save_image(const char* path);
+bool isactr_load_image(const char* path);
+
+// Checkpoints.
+// Save the model's dynamic state - time, buffers, pending events, DM -
+// under a name, and later put the model back in that state, say to run
+// several conditions from the same warmed-up model. Restoring drops any
+// chunks added to DM since the checkpoint was made. A run that stops at
+// its time limit leaves its pending events queued, so the next run, or
+// one from a checkpoint made then, carries on from where it stopped.
+bool isactr_checkpoint(LISPTR name);
+bool isactr_restore(LISPTR name);
+
+// Batch runs.
+// A batch runs replications of the current model, each from the model as
+// it is now, for duration seconds. They run on a pool of threads, one per
+// processor, each with a context of its own loaded from the model once.
+// Replication r's random stream is seeded from seed and r alone, so its
+// result doesn't depend on what else runs or in what order: batches of
+// replications first..first+count-1 can be split among processes and the
+// results merged by replication number. For now nothing in a run draws
+// on the stream - the engine has no noise, and !eval! isn't done yet -
+// so runs are deterministic, every replication gives the same result
+// and seed makes no difference; the streams are groundwork for when
+// something does. Every replication starts from a checkpoint of the
+// model, so Lisp variables a model sets from its productions aren't put
+// back between them.
+typedef struct {
+	int			replication;
+	double		time;			// simulated seconds at the end of the run
+	long long	firings;		// productions fired in the run
+} isactr_run_result;
+bool isactr_batch_run(int first, int count, double duration, unsigned long long seed, isactr_run_result* results);
+// The same as isactr_batch_run(0, count, ...), but each replication runs
+// in a process of its own, forked from this one once the model is
+// loaded, with up to workers of them at a time. The children share the
+// loaded model's memory copy-on-write, and send their results back over
+// a pipe. Where there's no fork, the replications run one after another.
+bool isactr_fork_batch_run(int count, int workers, double duration, unsigned long long seed, isactr_run_result* results);
+void isactr_print_results(FILE* out, const isactr_run_result* results, int count);
 
 void isactr_model_warning(const char* msg);
 
@@ -36,10 +99,10 @@ void isactr_define_chunk_type(LISPTR ct);
 // chunk format is (<name> ISA <chunktype> { <slotname> <value> })
 void isactr_add_dm(LISPTR chunk);
 
-// find and return the chunk in DM with the given name
+// find and return the chunk in DM with the given name, NIL if none
 LISPTR isactr_get_chunk(LISPTR chunk_name);
 
-// retrieve chunk matching pattern from DM
+// retrieve chunk matching pattern from DM, NIL if none
 LISPTR isactr_retrieve_chunk(LISPTR pattern);
 
 // Add a production to PM, lhs ==> rhs.
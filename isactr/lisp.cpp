@@ -2,26 +2,83 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
+#include <setjmp.h>
+#include <wchar.h>
 
-#define MAX_CELLS 32768
-#define MAX_SYMBOLS 32768
-#define MAX_STRING_POOL 1000000
-#define MAX_NUMBERS 32768
+#define SEGMENT_SHIFT 21
+#define SEGMENT_SIZE (1 << SEGMENT_SHIFT)	// 2MB, the large page size on x86 and x64
+#define SEGMENT_HEADER 64			// room at the start of a segment for its SEGMENT record
+#define SYMBOLS_PER_SEGMENT 4096
+#define MIN_SYMBOL_TABLE 8192		// power of 2
+#define MIN_NUMBER_TABLE 1024		// power of 2
 #define MAX_SUBRS 2000
+#define MAX_GC_ROOTS 64
+#define MAX_GC_MARKERS 16
+#define IMAGE_VERSION 3
+#define BITS_PER_WORD 32
+#define BITMAP_WORDS(n) (((n)+BITS_PER_WORD-1)/BITS_PER_WORD)
+#define BIT_TEST(map, i)	((map)[(i) / BITS_PER_WORD] & (1u << ((i) % BITS_PER_WORD)))
+#define BIT_SET(map, i)		((map)[(i) / BITS_PER_WORD] |= (1u << ((i) % BITS_PER_WORD)))
+#define BIT_CLEAR(map, i)	((map)[(i) / BITS_PER_WORD] &= ~(1u << ((i) % BITS_PER_WORD)))
 
-// strings are stored as pointers to their (wchar_t*) text
+// Strings are UTF-8. Each string in the pool is preceded by a one-unit
+// LISP_STRING_HEADER giving its length and hash, and the size in units
+// of its whole block (header, text and terminator), with the top bit set
+// while the block is free. The pool is allocated in 8-byte units so that
+// the text of every string is 8-byte aligned and can be tagged.
+#define STRING_FREE 0x8000
+#define STRING_BLOCK_MAX 0x7FFF
+#define STRING_UNIT 8
+#define STRING_LENGTH_MAX 0xFFFF
 
-typedef struct {
-	LISPTR	car, cdr;
+// Everything in the pools is 8-byte aligned, leaving the low 3 bits
+// of a pointer to it free for the type tag.
+#if defined(_MSC_VER)
+#define HEAP_ALIGN __declspec(align(8))
+#else
+#define HEAP_ALIGN __attribute__((aligned(8)))
+#endif
+
+#define CELL_OF(x)		((CELL*)lisp_untagged(x, TAG_CELL))
+#define SYMBOL_OF(x)	((SYMBOL*)lisp_untagged(x, TAG_SYMBOL))
+#define NUMBER_OF(x)	((NUMBER*)lisp_untagged(x, TAG_NUMBER))
+#define SUBR_OF(x)		((SUBR*)lisp_untagged(x, TAG_SUBR))
+
+// strings are stored as pointers to their (UTF-8) text
+typedef LISP_STRING_HEADER STRING_HEADER;
+
+// Define LISP_COMPACT_CELLS to build with 32-bit cell references:
+// the car and cdr of a cell are then packed references (see pack_ref)
+// instead of LISPTRs, so a cell takes 8 bytes instead of 16 on x64.
+// An arena is then limited to 2^(32-SEGMENT_SHIFT) segments, 4GB.
+#ifdef LISP_COMPACT_CELLS
+typedef uint32_t CELLREF;
+#define CELL_REF(x)	pack_ref(x)
+#define CELL_PTR(r)	unpack_ref(r)
+#define MAX_SEGMENTS (1 << (32 - SEGMENT_SHIFT))
+#else
+typedef LISPTR CELLREF;
+#define CELL_REF(x)	(x)
+#define CELL_PTR(r)	(r)
+#endif
+
+typedef struct HEAP_ALIGN {
+	CELLREF	car, cdr;
 } CELL;
 
-typedef struct {
+typedef union HEAP_ALIGN {
+	double	value;
+	void*	next;				// next free number
+} NUMBER;
+
+typedef struct HEAP_ALIGN {
 	LISPTR	name;				// string name
 	LISPTR	valueCell;			// value cell
 	LISPTR	fnCell;				// function cell
+	int		index;				// position in the symbol segments
 } SYMBOL;
 
-typedef struct {
+typedef struct HEAP_ALIGN {
 	int			nargs;			// number of parameters. -1=FSUBR
 	union {
 		NATIVE1ARGS	fsubr;
@@ -32,6 +89,37 @@ typedef struct {
 	};
 } SUBR;
 
+struct _ARENA;
+
+// A segment of an arena: SEGMENT_SIZE bytes on a SEGMENT_SIZE boundary,
+// so the segment holding any object is found by masking its address.
+// This record is at the start, followed by the objects.
+typedef struct _SEGMENT {
+	struct _ARENA*	arena;
+	int				index;			// position in the arena's segments
+	int				used;			// objects handed out so far (units, for strings)
+	unsigned*		marks;			// GC mark bit of each object
+	unsigned*		starts;			// strings only: where each string's text starts
+	bool			region;			// cells only: part of the region, see lisp_region_begin
+} SEGMENT;
+
+#define SEGMENT_OF(p)		((SEGMENT*)((uintptr_t)(p) & ~(uintptr_t)(SEGMENT_SIZE-1)))
+#define SEGMENT_BASE(seg)	((char*)(seg) + SEGMENT_HEADER)
+
+// A growable pool of objects of one size. Segments are added as
+// needed and never move, so objects keep their addresses.
+typedef struct _ARENA {
+	const char*		name;
+	size_t			size;			// bytes per object
+	int				capacity;		// objects per segment
+	SEGMENT**		segments;
+	int				segmentCount;
+	int				segmentCapacity;
+	int				bump;			// the segment new objects are taken from
+	int				inUse;			// objects allocated and not since collected
+	int				peak;			// high-water mark of inUse
+} ARENA;
+
 LISPTR subr_atomp(LISPTR x)
 {
 	return atomp(x) ? T : NIL;
@@ -52,30 +140,512 @@ LISPTR subr_quit(void)
 	exit(0);
 }
 
-static CELL cellBlock[MAX_CELLS];
-static int cellCount;
-static SYMBOL symPool[MAX_SYMBOLS];
-static int symCount;
-static wchar_t stringPool[MAX_STRING_POOL];
-static int stringCount;
-static double numberPool[MAX_NUMBERS];
-static int numberCount;
-static SUBR subrPool[MAX_SUBRS];
-static int subrCount;
+LISPTR subr_room(void)
+{
+	lisp_room(stdout);
+	return NIL;
+}
+
+// Everything one Lisp owns. Each thread has its own current Lisp, and
+// the heap functions work on that one; see lisp_switch.
+struct _LISP_STATE {
+	ARENA			cellArena;
+	ARENA			numberArena;
+	ARENA			stringArena;
+	SEGMENT**		allSegments;		// every arena's segments, by address
+	int				allSegmentCount;
+	int				allSegmentCapacity;
+	SYMBOL**		symSegments;
+	int				symSegmentCount;
+	int				symSegmentCapacity;
+	int				symCount;
+	SYMBOL**		symTable;			// open-addressed index of symbols by name
+	int				symTableSize;		// power of 2, at least twice symCount
+	NUMBER**		numberTable;		// open-addressed index of boxed numbers by value
+	int				numberTableSize;	// power of 2, at least twice the numbers in use
+	SUBR			subrPool[MAX_SUBRS];
+	int				subrCount;
+
+	// the region: cell segments that cons bumps through while a region is open
+	SEGMENT**		regionSegments;		// in the order they're used
+	int				regionSegmentCount;
+	int				regionSegmentCapacity;
+	int				regionCurrent;		// the segment cells are being taken from
+	bool			regionOpen;
+	int				regionPeak;			// most cells used by one region
+
+	// collector state
+	CELL*			freeCells;
+	NUMBER*			freeNumbers;
+	LISPTR*			gcRoots[MAX_GC_ROOTS];
+	int				gcRootCount;
+	LISP_GC_MARKER	gcMarkers[MAX_GC_MARKERS];
+	int				gcMarkerCount;
+	int				gcCount;
+
+	// heap images
+	LISP_FOREIGN_INDEX	foreignIndex;
+	LISP_FOREIGN_AT	foreignAt;
+
+#ifdef LISP_COMPACT_CELLS
+	// LISPTRs that don't pack into 32 bits, for cells to refer to by number
+	LISPTR*			wideRefs;
+	int				wideCount;
+	int				wideCapacity;
+	int*			wideTable;			// open-addressed index of wideRefs, -1 = empty
+	int				wideTableSize;		// power of 2, at least twice wideCount
+	int*			wideFree;			// entries of wideRefs that are free to reuse
+	int				wideFreeCount;
+	int				wideFreeCapacity;
+	unsigned*		wideMarks;			// while collecting: the entries live cells refer to
+#endif
+
+	void*			eval;				// the evaluator's and reader's parts
+	void*			reader;
+};
 
-const LISPTR NIL = &symPool[0];
-const LISPTR T = &symPool[1];
-const LISPTR QUOTE = &symPool[2];
-const LISPTR FUNCTION = &symPool[3];
-const LISPTR LAMBDA = &symPool[4];
+static LISP_THREAD LISP_STATE* current;	// this thread's current Lisp
+static LISP_THREAD void* stackBase;		// of this thread, for the collector
+
+#define SYMBOL_AT(i) (&current->symSegments[(i) / SYMBOLS_PER_SEGMENT][(i) % SYMBOLS_PER_SEGMENT])
+
+#ifdef LISP_COMPACT_CELLS
+#define FREE_CELL ((CELLREF)TAG_CODE)		// car of every cell on the free list (code is never packed)
+#else
+static char freeCellTag;
+#define FREE_CELL ((LISPTR)&freeCellTag)	// car of every cell on the free list
+#endif
+
+// the current Lisp's first symbols, set by lisp_switch
+LISP_THREAD LISPTR NIL;
+LISP_THREAD LISPTR T;
+LISP_THREAD LISPTR QUOTE;
+LISP_THREAD LISPTR FUNCTION;
+LISP_THREAD LISPTR LAMBDA;
+
+static void out_of_memory(const wchar_t* msg)
+{
+	lisp_error(msg);
+	exit(EXIT_FAILURE);
+}
+
+// Make room in a malloc'd array for at least one more item.
+static bool grow_array(void** items, int* capacity, int count, size_t itemSize)
+{
+	if (count < *capacity) {
+		return true;
+	}
+	int n = *capacity ? 2 * *capacity : 16;
+	void* p = realloc(*items, n * itemSize);
+	if (!p) {
+		return false;
+	}
+	*items = p;
+	*capacity = n;
+	return true;
+} // grow_array
+
+#ifdef LISP_COMPACT_CELLS
+static unsigned wide_hash(LISPTR x)
+{
+	uintptr_t h = (uintptr_t)x;
+	h ^= h >> 29;
+	return (unsigned)(h * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+// Make wideTable size entries and index wideRefs in it. False if out of memory.
+static bool wide_table_reset(int size)
+{
+	int* table = (int*)malloc(size * sizeof(int));
+	if (!table) {
+		return false;
+	}
+	for (int i = 0; i < size; i++) {
+		table[i] = -1;
+	}
+	free(current->wideTable);
+	current->wideTable = table;
+	current->wideTableSize = size;
+	unsigned mask = size - 1;
+	for (int i = 0; i < current->wideCount; i++) {
+		if (current->wideRefs[i]) {
+			unsigned h;
+			for (h = wide_hash(current->wideRefs[i]) & mask; current->wideTable[h] >= 0; h = (h+1) & mask) {}
+			current->wideTable[h] = i;
+		}
+	}
+	return true;
+} // wide_table_reset
+
+// Number of x in wideRefs, adding it if it's new.
+static int wide_index(LISPTR x)
+{
+	unsigned mask = current->wideTableSize - 1;
+	unsigned h = wide_hash(x) & mask;
+	for (; current->wideTable && current->wideTable[h] >= 0; h = (h+1) & mask) {
+		if (current->wideRefs[current->wideTable[h]] == x) {
+			return current->wideTable[h];
+		}
+	}
+	if (2 * (current->wideCount+1) > current->wideTableSize) {
+		if (!wide_table_reset(current->wideTableSize ? 2 * current->wideTableSize : 256)) {
+			out_of_memory(L"out of memory for the Lisp heap");
+		}
+		mask = current->wideTableSize - 1;
+		for (h = wide_hash(x) & mask; current->wideTable[h] >= 0; h = (h+1) & mask) {}
+	}
+	int n;
+	if (current->wideFreeCount > 0) {
+		n = current->wideFree[--current->wideFreeCount];
+	} else {
+		if (!grow_array((void**)&current->wideRefs, &current->wideCapacity, current->wideCount, sizeof(LISPTR))) {
+			out_of_memory(L"out of memory for the Lisp heap");
+		}
+		n = current->wideCount++;
+	}
+	current->wideRefs[n] = x;
+	current->wideTable[h] = n;
+	return n;
+} // wide_index
+
+// Called on each reference in a live cell while collecting:
+// if it's to an entry of wideRefs, that entry is in use.
+static inline void wide_mark(CELLREF r)
+{
+	if ((r & LISP_TAG_MASK) == TAG_FOREIGN && r != 0 && current->wideMarks) {
+		BIT_SET(current->wideMarks, (r >> 3) - 1);
+	}
+}
+
+// After collecting, free the entries of wideRefs no live cell refers
+// to, for wide_index to reuse. A cell that isn't live may still refer
+// to a freed entry, but nothing will read it.
+static void wide_sweep(void)
+{
+	if (!current->wideMarks) {
+		return;					// there was no memory to mark them: keep them all
+	}
+	current->wideFreeCount = 0;
+	for (int i = 0; i < current->wideCount; i++) {
+		if (!BIT_TEST(current->wideMarks, i)) {
+			current->wideRefs[i] = NULL;
+			// if there's no room to list it, the entry just isn't reused
+			if (grow_array((void**)&current->wideFree, &current->wideFreeCapacity, current->wideFreeCount, sizeof(int))) {
+				current->wideFree[current->wideFreeCount++] = i;
+			}
+		}
+	}
+	free(current->wideMarks);
+	current->wideMarks = NULL;
+	if (current->wideTableSize > 0 && !wide_table_reset(current->wideTableSize)) {
+		out_of_memory(L"out of memory for the Lisp heap");
+	}
+} // wide_sweep
+
+static void wide_reset(void)
+{
+	free(current->wideRefs);
+	free(current->wideTable);
+	free(current->wideFree);
+	current->wideRefs = NULL;
+	current->wideTable = NULL;
+	current->wideFree = NULL;
+	current->wideCount = current->wideCapacity = current->wideTableSize = 0;
+	current->wideFreeCount = current->wideFreeCapacity = 0;
+}
+
+// Pack x into a cell reference. Like a LISPTR, the low 3 bits are its tag.
+// A cell, number or string is its segment's index in its arena and its
+// offset in the segment. Symbols and SUBRs are numbered, and fixnums
+// that fit are kept as they are. Anything else - foreign pointers, code,
+// big fixnums - goes in wideRefs, and is referred to by its number there
+// plus one, with tag 0. NULL packs to 0. The collector frees the entries
+// no live cell refers to any more (see wide_sweep).
+static inline CELLREF pack_ref(LISPTR x)
+{
+	uintptr_t u = (uintptr_t)x;
+	switch (lisp_tag(x)) {
+	case TAG_CELL:
+	case TAG_NUMBER:
+	case TAG_STRING:
+		return (CELLREF)(((uintptr_t)SEGMENT_OF(x)->index << SEGMENT_SHIFT) | (u & (SEGMENT_SIZE-1)));
+	case TAG_SYMBOL:
+		return (CELLREF)((SYMBOL_OF(x)->index << 3) | TAG_SYMBOL);
+	case TAG_SUBR:
+		return (CELLREF)(((SUBR_OF(x) - current->subrPool) << 3) | TAG_SUBR);
+	case TAG_FIXNUM:
+		if ((intptr_t)(int32_t)(uint32_t)u == (intptr_t)u) {
+			return (CELLREF)u;
+		}
+		break;
+	case TAG_FOREIGN:
+		if (x == NULL) {
+			return 0;
+		}
+		break;
+	}
+	return (CELLREF)((wide_index(x) + 1) << 3);
+} // pack_ref
+
+static inline LISPTR unpack_ref(CELLREF r)
+{
+	switch (r & LISP_TAG_MASK) {
+	case TAG_CELL:
+		return (LISPTR)((char*)current->cellArena.segments[r >> SEGMENT_SHIFT] + (r & (SEGMENT_SIZE-1)));
+	case TAG_NUMBER:
+		return (LISPTR)((char*)current->numberArena.segments[r >> SEGMENT_SHIFT] + (r & (SEGMENT_SIZE-1)));
+	case TAG_STRING:
+		return (LISPTR)((char*)current->stringArena.segments[r >> SEGMENT_SHIFT] + (r & (SEGMENT_SIZE-1)));
+	case TAG_SYMBOL:
+		return lisp_tagged(SYMBOL_AT(r >> 3), TAG_SYMBOL);
+	case TAG_SUBR:
+		return lisp_tagged(&current->subrPool[r >> 3], TAG_SUBR);
+	case TAG_FIXNUM:
+		return (LISPTR)(intptr_t)(int32_t)r;
+	default:
+		return r ? current->wideRefs[(r >> 3) - 1] : NULL;
+	}
+} // unpack_ref
+#endif
+
+static void* segment_alloc(void)
+{
+#if defined(_MSC_VER)
+	return _aligned_malloc(SEGMENT_SIZE, SEGMENT_SIZE);
+#else
+	void* p;
+	return posix_memalign(&p, SEGMENT_SIZE, SEGMENT_SIZE) ? NULL : p;
+#endif
+}
+
+static void segment_free(void* p)
+{
+#if defined(_MSC_VER)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+// Add a segment to arena a, returning false if there's no memory for it.
+static bool arena_add_segment(ARENA* a)
+{
+#ifdef LISP_COMPACT_CELLS
+	if (a->segmentCount == MAX_SEGMENTS) {
+		return false;
+	}
+#endif
+	if (!grow_array((void**)&a->segments, &a->segmentCapacity, a->segmentCount, sizeof(SEGMENT*)) ||
+		!grow_array((void**)&current->allSegments, &current->allSegmentCapacity, current->allSegmentCount, sizeof(SEGMENT*))) {
+		return false;
+	}
+	SEGMENT* seg = (SEGMENT*)segment_alloc();
+	if (!seg) {
+		return false;
+	}
+	seg->arena = a;
+	seg->index = a->segmentCount;
+	seg->used = 0;
+	seg->region = false;
+	seg->marks = (unsigned*)calloc(BITMAP_WORDS(a->capacity), sizeof(unsigned));
+	seg->starts = (a == &current->stringArena) ? (unsigned*)calloc(BITMAP_WORDS(a->capacity), sizeof(unsigned)) : NULL;
+	if (!seg->marks || (a == &current->stringArena && !seg->starts)) {
+		free(seg->marks);
+		free(seg->starts);
+		segment_free(seg);
+		return false;
+	}
+	a->segments[a->segmentCount++] = seg;
+	// keep allSegments in address order
+	int i = current->allSegmentCount++;
+	while (i > 0 && current->allSegments[i-1] > seg) {
+		current->allSegments[i] = current->allSegments[i-1];
+		i--;
+	}
+	current->allSegments[i] = seg;
+	return true;
+} // arena_add_segment
+
+static void arena_init(ARENA* a)
+{
+	a->capacity = (int)((SEGMENT_SIZE - SEGMENT_HEADER) / a->size);
+	a->inUse = a->peak = 0;
+	if (!arena_add_segment(a)) {
+		out_of_memory(L"no memory for the Lisp heap");
+	}
+	a->bump = 0;
+}
+
+static void arena_release(ARENA* a)
+{
+	for (int i = 0; i < a->segmentCount; i++) {
+		free(a->segments[i]->marks);
+		free(a->segments[i]->starts);
+		segment_free(a->segments[i]);
+	}
+	free(a->segments);
+	a->segments = NULL;
+	a->segmentCount = a->segmentCapacity = 0;
+	a->bump = 0;
+	if (a == &current->cellArena) {
+		free(current->regionSegments);
+		current->regionSegments = NULL;
+		current->regionSegmentCount = current->regionSegmentCapacity = 0;
+		current->regionCurrent = 0;
+		current->regionOpen = false;
+	}
+}
+
+// Take the next unused object from the bump segment, NULL if it's full.
+static void* arena_bump(ARENA* a)
+{
+	SEGMENT* seg = a->segments[a->bump];
+	if (seg->used == a->capacity) {
+		return NULL;
+	}
+	return SEGMENT_BASE(seg) + (seg->used++) * a->size;
+}
+
+static inline void arena_count(ARENA* a, int n)
+{
+	a->inUse += n;
+	if (a->inUse > a->peak) {
+		a->peak = a->inUse;
+	}
+}
+
+// Called when arena a has no space left: collect garbage, and if
+// that leaves the arena more than half full, add a segment as well.
+static void make_room(ARENA* a)
+{
+	lisp_gc();
+	int segments = a->segmentCount - (a == &current->cellArena ? current->regionSegmentCount : 0);
+	if (a->inUse > segments * (a->capacity / 2)) {
+		if (!arena_add_segment(a)) {
+			out_of_memory(L"out of memory for the Lisp heap");
+		}
+		a->bump = a->segmentCount - 1;
+	}
+}
+
+// Add a segment to the region. False if there's no memory for it.
+static bool region_add_segment(void)
+{
+	if (!grow_array((void**)&current->regionSegments, &current->regionSegmentCapacity, current->regionSegmentCount, sizeof(SEGMENT*)) ||
+		!arena_add_segment(&current->cellArena)) {
+		return false;
+	}
+	SEGMENT* seg = current->cellArena.segments[current->cellArena.segmentCount-1];
+	seg->region = true;
+	current->regionSegments[current->regionSegmentCount++] = seg;
+	return true;
+}
+
+// Take a cell from the region.
+static CELL* region_cell(void)
+{
+	SEGMENT* seg = current->regionSegments[current->regionCurrent];
+	if (seg->used == current->cellArena.capacity) {
+		if (current->regionCurrent+1 == current->regionSegmentCount && !region_add_segment()) {
+			out_of_memory(L"out of memory for the Lisp heap");
+		}
+		seg = current->regionSegments[++current->regionCurrent];
+	}
+	return (CELL*)SEGMENT_BASE(seg) + seg->used++;
+}
+
+void lisp_region_begin(void)
+{
+	if (current->regionSegmentCount == 0 && !region_add_segment()) {
+		out_of_memory(L"out of memory for the Lisp heap");
+	}
+	current->regionCurrent = 0;
+	current->regionOpen = true;
+}
+
+void lisp_region_end(void)
+{
+	int used = current->regionCurrent * current->cellArena.capacity + current->regionSegments[current->regionCurrent]->used;
+	if (used > current->regionPeak) {
+		current->regionPeak = used;
+	}
+	// segments past regionCurrent haven't been used since the last reset
+	for (int i = 0; i <= current->regionCurrent; i++) {
+		current->regionSegments[i]->used = 0;
+	}
+	current->regionCurrent = 0;
+	current->regionOpen = false;
+}
+
+// Copy of x, with the cells of it taken from the region copied to the heap.
+static LISPTR region_keep(LISPTR x)
+{
+	if (!consp(x) || !SEGMENT_OF(x)->region) {
+		return x;
+	}
+	LISPTR head = cons(region_keep(car(x)), NIL);
+	LISPTR last = head;
+	for (x = cdr(x); consp(x) && SEGMENT_OF(x)->region; x = cdr(x)) {
+		LISPTR cell = cons(region_keep(car(x)), NIL);
+		rplacd(last, cell);
+		last = cell;
+	}
+	rplacd(last, x);
+	return head;
+}
+
+LISPTR lisp_region_keep(LISPTR x)
+{
+	bool open = current->regionOpen;
+	current->regionOpen = false;		// so cons takes from the heap
+	x = region_keep(x);
+	current->regionOpen = open;
+	return x;
+}
+
+static bool add_symbol_segment(void);
+
+// Point NIL, T and the rest at the current Lisp's first symbols,
+// which lisp_init always interns first, in this order.
+static void set_first_symbols(void)
+{
+	NIL = current ? lisp_tagged(SYMBOL_AT(0), TAG_SYMBOL) : NULL;
+	T = current ? lisp_tagged(SYMBOL_AT(1), TAG_SYMBOL) : NULL;
+	QUOTE = current ? lisp_tagged(SYMBOL_AT(2), TAG_SYMBOL) : NULL;
+	FUNCTION = current ? lisp_tagged(SYMBOL_AT(3), TAG_SYMBOL) : NULL;
+	LAMBDA = current ? lisp_tagged(SYMBOL_AT(4), TAG_SYMBOL) : NULL;
+}
 
 void lisp_init(void)
 {
-	cellCount = 0;
-	symCount = 0;
-	stringCount = 0;
-	numberCount = 0;
-	subrCount = 0;
+	LISP_STATE* s = (LISP_STATE*)calloc(1, sizeof(LISP_STATE));
+	if (!s) {
+		out_of_memory(L"no memory for the Lisp heap");
+	}
+	s->cellArena.name = "cells";
+	s->cellArena.size = sizeof(CELL);
+	s->numberArena.name = "numbers";
+	s->numberArena.size = sizeof(NUMBER);
+	s->stringArena.name = "string units";
+	s->stringArena.size = STRING_UNIT;
+	s->eval = lisp_eval_create();
+	s->reader = lisp_reader_create();
+	if (!s->eval || !s->reader) {
+		out_of_memory(L"no memory for the Lisp heap");
+	}
+	lisp_switch(NULL);
+	current = s;
+	arena_init(&current->cellArena);
+	arena_init(&current->numberArena);
+	arena_init(&current->stringArena);
+	current->symTableSize = MIN_SYMBOL_TABLE;
+	current->symTable = (SYMBOL**)calloc(current->symTableSize, sizeof(SYMBOL*));
+	current->numberTableSize = MIN_NUMBER_TABLE;
+	current->numberTable = (NUMBER**)calloc(current->numberTableSize, sizeof(NUMBER*));
+	if (!current->symTable || !current->numberTable || !add_symbol_segment()) {
+		out_of_memory(L"no memory for the Lisp heap");
+	}
+	lisp_switch(s);
 	intern(L"NIL");
 	intern(L"T");
 	intern(L"QUOTE");
@@ -91,69 +661,85 @@ void lisp_init(void)
 	def_subr2(L"EQ", subr_eq);
 	def_subr2(L"ASSOC", assoc);
 	def_subr0(L"QUIT", subr_quit);
+	def_subr0(L"ROOM", subr_room);
+	init_lisp_eval();
 }
 
 void lisp_shutdown(void)
 {
+	if (!current) {
+		return;
+	}
+	lisp_shutdown_eval();
+	lisp_reader_shutdown();
+	arena_release(&current->cellArena);
+	arena_release(&current->numberArena);
+	arena_release(&current->stringArena);
+	free(current->allSegments);
+	for (int i = 0; i < current->symSegmentCount; i++) {
+		free(current->symSegments[i]);
+	}
+	free(current->symSegments);
+	free(current->symTable);
+	free(current->numberTable);
+	free(current->regionSegments);
+#ifdef LISP_COMPACT_CELLS
+	wide_reset();
+#endif
+	free(current);
+	lisp_switch(NULL);
 }
 
-void lisp_error(const wchar_t* msg)
-{
-	fwprintf(stdout, L"**ERROR: %s\n", msg);
-}
-
-LISPTR cons(LISPTR x, LISPTR y)
-{
-	CELL* c = &cellBlock[cellCount++];
-	c->car = x;
-	c->cdr = y;
-	return (LISPTR)c;
-}
-
-bool consp(LISPTR x)
-{
-	return x >= &cellBlock[0] &&
-		   x < &cellBlock[MAX_CELLS] &&
-		   !(((char*)x-(char*)cellBlock) % sizeof(cellBlock[0]));
-}
-
-bool listp(LISPTR x)
-{
-	return x==NIL || consp(x);
-}
+///////////////////////////////////////////////////////////////////////
+// Lisp states
 
-bool atomp(LISPTR x)
+LISP_STATE* lisp_current(void)
 {
-	return !consp(x);
+	return current;
 }
 
-bool symbolp(LISPTR x)
+void lisp_switch(LISP_STATE* state)
 {
-	return x >= &symPool[0] &&
-		   x < &symPool[MAX_SYMBOLS];
+	current = state;
+	set_first_symbols();
+	lisp_eval_switch(state ? state->eval : NULL);
+	lisp_reader_switch(state ? state->reader : NULL);
 }
 
-bool stringp(LISPTR x)
+void lisp_error(const wchar_t* msg)
 {
-	return x >= &stringPool[0] &&
-		   x < &stringPool[MAX_STRING_POOL];
+	fprintf(stdout, "**ERROR: %ls\n", msg);
 }
 
-bool numberp(LISPTR x)
+// Put cell c on the free list. Its cdr is the next free cell.
+static inline void free_cell(CELL* c)
 {
-	return x >= &numberPool[0] &&
-		   x < &numberPool[MAX_NUMBERS];
+	c->car = FREE_CELL;
+	c->cdr = CELL_REF(current->freeCells ? lisp_tagged(current->freeCells, TAG_CELL) : NIL);
+	current->freeCells = c;
 }
 
-bool eql(LISPTR x, LISPTR y)
+LISPTR cons(LISPTR x, LISPTR y)
 {
-	if (x == y) {
-		return true;
-	}
-	if (numberp(x)) {
-		return numberp(y) && number_value(x)==number_value(y);
+	CELL* c;
+	if (current->regionOpen) {
+		c = region_cell();
+	} else {
+		if (!current->freeCells && current->cellArena.segments[current->cellArena.bump]->used == current->cellArena.capacity) {
+			make_room(&current->cellArena);
+		}
+		c = current->freeCells;
+		if (c) {
+			LISPTR next = CELL_PTR(c->cdr);
+			current->freeCells = consp(next) ? CELL_OF(next) : NULL;
+		} else {
+			c = (CELL*)arena_bump(&current->cellArena);
+		}
+		arena_count(&current->cellArena, 1);
 	}
-	return false;
+	c->car = CELL_REF(x);
+	c->cdr = CELL_REF(y);
+	return lisp_tagged(c, TAG_CELL);
 }
 
 LISPTR assoc(LISPTR item, LISPTR alist)
@@ -171,7 +757,7 @@ LISPTR assoc(LISPTR item, LISPTR alist)
 LISPTR car(LISPTR x)
 {
 	if (consp(x)) {
-		return ((CELL*)x)->car;
+		return CELL_PTR(CELL_OF(x)->car);
 	}
 	if (x != NIL) {
 		lisp_error(L"bad arg to car");
@@ -182,7 +768,7 @@ LISPTR car(LISPTR x)
 LISPTR cdr(LISPTR x)
 {
 	if (consp(x)) {
-		return ((CELL*)x)->cdr;
+		return CELL_PTR(CELL_OF(x)->cdr);
 	}
 	if (x != NIL) {
 		lisp_error(L"bad arg to cdr");
@@ -193,9 +779,9 @@ LISPTR cdr(LISPTR x)
 LISPTR cadr(LISPTR x)
 {
 	if (consp(x)) {
-		x = ((CELL*)x)->cdr;
+		x = CELL_PTR(CELL_OF(x)->cdr);
 		if (consp(x)) {
-			return ((CELL*)x)->car;
+			return CELL_PTR(CELL_OF(x)->car);
 		}
 	}
 	if (x != NIL) {
@@ -207,9 +793,9 @@ LISPTR cadr(LISPTR x)
 LISPTR cddr(LISPTR x)
 {
 	if (consp(x)) {
-		x = ((CELL*)x)->cdr;
+		x = CELL_PTR(CELL_OF(x)->cdr);
 		if (consp(x)) {
-			return ((CELL*)x)->cdr;
+			return CELL_PTR(CELL_OF(x)->cdr);
 		}
 	}
 	if (x != NIL) {
@@ -221,11 +807,11 @@ LISPTR cddr(LISPTR x)
 LISPTR caddr(LISPTR x)
 {
 	if (consp(x)) {
-		x = ((CELL*)x)->cdr;
+		x = CELL_PTR(CELL_OF(x)->cdr);
 		if (consp(x)) {
-			x = ((CELL*)x)->cdr;
+			x = CELL_PTR(CELL_OF(x)->cdr);
 			if (consp(x)) {
-				return ((CELL*)x)->car;
+				return CELL_PTR(CELL_OF(x)->car);
 			}
 		}
 	}
@@ -238,7 +824,7 @@ LISPTR caddr(LISPTR x)
 LISPTR cadddr(LISPTR x)
 {
 	if (consp(x)) {
-		return caddr(((CELL*)x)->cdr);
+		return caddr(CELL_PTR(CELL_OF(x)->cdr));
 	}
 	if (x != NIL) {
 		lisp_error(L"bad arg to caddr");
@@ -250,14 +836,20 @@ LISPTR cadddr(LISPTR x)
 LISPTR defvar(LISPTR x, LISPTR y)
 {
 	if (symbolp(x)) {
-		((SYMBOL*)x)->valueCell = y;
+		SYMBOL_OF(x)->valueCell = y;
 	}
 	return x;
 }
 
+LISPTR rplaca(LISPTR x, LISPTR y)
+{
+	CELL_OF(x)->car = CELL_REF(y);
+	return x;
+}
+
 LISPTR rplacd(LISPTR x, LISPTR y)
 {
-	((CELL*)x)->cdr = y;
+	CELL_OF(x)->cdr = CELL_REF(y);
 	return x;
 }
 
@@ -271,42 +863,325 @@ LISPTR nconc(LISPTR x, LISPTR y)
 		lisp_error(L"1st argument to nconc is not a list");
 		return NIL;
 	}
-	// lazy, lazy. Is this how your mama taught you?
-	return rplacd(x, nconc(cdr(x), y));
+	LISPTR last = x;
+	while (consp(CELL_PTR(CELL_OF(last)->cdr))) {
+		last = CELL_PTR(CELL_OF(last)->cdr);
+	}
+	rplacd(last, y);
+	return x;
 } // nconc
 
-LISPTR intern_string(const wchar_t* s)
+// Find room for a string block of n units in segment seg, returning
+// a pointer to its header or NULL. Blocks come from the end of the
+// segment while it lasts, then from the holes left by the collector,
+// first fit.
+static STRING_HEADER* alloc_string_block(SEGMENT* seg, int n)
 {
-	wcscpy_s(stringPool+stringCount, MAX_STRING_POOL-1-stringCount, s);
-	LISPTR x = (LISPTR)(stringPool+stringCount);
-	stringCount += wcslen(s)+1;
-	return x;
+	STRING_HEADER* pool = (STRING_HEADER*)SEGMENT_BASE(seg);
+	if (seg->used + n <= current->stringArena.capacity) {
+		STRING_HEADER* block = pool + seg->used;
+		seg->used += n;
+		block->block = (unsigned short)n;
+		return block;
+	}
+	for (int i = 0; i < seg->used; i += pool[i].block & STRING_BLOCK_MAX) {
+		int size = pool[i].block & STRING_BLOCK_MAX;
+		if ((pool[i].block & STRING_FREE) && size >= n) {
+			if (size > n) {
+				// split off the rest as a smaller hole
+				pool[i+n].block = (unsigned short)(STRING_FREE | (size - n));
+				size = n;
+			}
+			pool[i].block = (unsigned short)size;
+			return pool + i;
+		}
+	}
+	return NULL;
+} // alloc_string_block
+
+static STRING_HEADER* find_string_block(int n)
+{
+	for (int i = current->stringArena.segmentCount-1; i >= 0; i--) {
+		STRING_HEADER* block = alloc_string_block(current->stringArena.segments[i], n);
+		if (block) {
+			return block;
+		}
+	}
+	return NULL;
 }
 
-LISPTR intern_number(const wchar_t* s)
+static unsigned name_hash(const char* s, int len)
+{
+	// FNV-1a
+	unsigned h = 2166136261u;
+	for (int i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	}
+	return h;
+}
+
+// Make a string of the len bytes of UTF-8 at s.
+LISPTR intern_string_utf8(const char* s, int len)
+{
+	if (len > STRING_LENGTH_MAX) {
+		lisp_error(L"string too long");
+		return NIL;
+	}
+	int n = 1 + (len + STRING_UNIT) / STRING_UNIT;		// header, text and terminator
+	STRING_HEADER* block = find_string_block(n);
+	if (!block) {
+		make_room(&current->stringArena);
+		block = find_string_block(n);
+	}
+	if (!block) {
+		// free space is too fragmented
+		if (!arena_add_segment(&current->stringArena)) {
+			out_of_memory(L"out of memory for strings");
+		}
+		block = find_string_block(n);
+	}
+	arena_count(&current->stringArena, n);
+	block->length = (unsigned short)len;
+	block->hash = name_hash(s, len);
+	char* text = (char*)(block + 1);
+	memcpy(text, s, len);
+	text[len] = 0;
+	SEGMENT* seg = SEGMENT_OF(text);
+	BIT_SET(seg->starts, (int)((STRING_HEADER*)text - (STRING_HEADER*)SEGMENT_BASE(seg)));
+	return lisp_tagged(text, TAG_STRING);
+} // intern_string_utf8
+
+// Write character c to out as UTF-8, returning the number of bytes (1-4).
+int utf8_encode(char* out, int c)
 {
-	LISPTR x = (LISPTR)&numberPool[numberCount++];
-	wchar_t* ep;
-	*((double*)x) = wcstod(s, &ep);
+	if (c < 0x80) {
+		out[0] = (char)c;
+		return 1;
+	}
+	if (c < 0x800) {
+		out[0] = (char)(0xC0 | (c >> 6));
+		out[1] = (char)(0x80 | (c & 0x3F));
+		return 2;
+	}
+	if (c < 0x10000) {
+		out[0] = (char)(0xE0 | (c >> 12));
+		out[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+		out[2] = (char)(0x80 | (c & 0x3F));
+		return 3;
+	}
+	out[0] = (char)(0xF0 | (c >> 18));
+	out[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+	out[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+	out[3] = (char)(0x80 | (c & 0x3F));
+	return 4;
+} // utf8_encode
+
+// Convert wide string s to UTF-8 and make it into a string or symbol
+// with make. The conversion is on the stack unless s is long.
+static LISPTR from_wide(const wchar_t* s, LISPTR (*make)(const char*, int))
+{
+	char local[256];
+	size_t size = 4 * wcslen(s) + 1;
+	char* buf = (size <= sizeof local) ? local : (char*)malloc(size);
+	if (!buf) {
+		out_of_memory(L"out of memory for strings");
+	}
+	int n = 0;
+	while (*s) {
+		int c = (int)*s++;
+		if (sizeof(wchar_t) == 2 && c >= 0xD800 && c < 0xDC00 && *s >= 0xDC00 && *s < 0xE000) {
+			c = 0x10000 + ((c - 0xD800) << 10) + ((int)*s++ - 0xDC00);
+		}
+		n += utf8_encode(buf+n, c);
+	}
+	buf[n] = 0;
+	LISPTR x = make(buf, n);
+	if (buf != local) {
+		free(buf);
+	}
 	return x;
+} // from_wide
+
+LISPTR intern_string(const wchar_t* s)
+{
+	return from_wide(s, intern_string_utf8);
 }
 
-LISPTR intern(const wchar_t* s)
+static unsigned number_hash(double d)
 {
-	int i;
-	for (i = 0; i < symCount; i++) {
-		if (0==wcscmp(string_text(symPool[i].name), s)) {
-			break;
+	unsigned long long bits;
+	memcpy(&bits, &d, sizeof bits);
+	unsigned h = (unsigned)(bits ^ (bits >> 32));
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h;
+}
+
+static void number_table_insert(NUMBER* n)
+{
+	unsigned i = number_hash(n->value) & (current->numberTableSize-1);
+	while (current->numberTable[i]) {
+		if (current->numberTable[i]->value == n->value) {
+			return;				// already there
+		}
+		i = (i + 1) & (current->numberTableSize-1);
+	}
+	current->numberTable[i] = n;
+}
+
+// Empty the number table, sizing it for count numbers.
+static bool number_table_reset(int count)
+{
+	int size = MIN_NUMBER_TABLE;
+	while (size < 2 * count) {
+		size *= 2;
+	}
+	if (size != current->numberTableSize) {
+		NUMBER** table = (NUMBER**)malloc(size * sizeof(NUMBER*));
+		if (!table) {
+			return false;
+		}
+		free(current->numberTable);
+		current->numberTable = table;
+		current->numberTableSize = size;
+	}
+	memset(current->numberTable, 0, current->numberTableSize * sizeof(NUMBER*));
+	return true;
+}
+
+// Return the number with value d. Integers that fit are fixnums,
+// anything else is boxed, with one box per value so that equal
+// numbers are always the same LISPTR.
+LISPTR make_number(double d)
+{
+	if (d > FIXNUM_MIN && d < FIXNUM_MAX && d == (double)(intptr_t)d) {
+		// includes -0.0, which becomes 0
+		return (LISPTR)((intptr_t)d * 8 + TAG_FIXNUM);
+	}
+	unsigned i = number_hash(d) & (current->numberTableSize-1);
+	NUMBER* n;
+	while ((n = current->numberTable[i]) != NULL) {
+		if (n->value == d) {
+			return lisp_tagged(n, TAG_NUMBER);
+		}
+		i = (i + 1) & (current->numberTableSize-1);
+	}
+	if (!current->freeNumbers && current->numberArena.segments[current->numberArena.bump]->used == current->numberArena.capacity) {
+		make_room(&current->numberArena);
+	}
+	n = current->freeNumbers;
+	if (n) {
+		current->freeNumbers = (NUMBER*)n->next;
+	} else {
+		n = (NUMBER*)arena_bump(&current->numberArena);
+	}
+	arena_count(&current->numberArena, 1);
+	n->value = d;
+	if (2 * current->numberArena.inUse > current->numberTableSize) {
+		// rehash into a bigger table
+		NUMBER** old = current->numberTable;
+		int oldSize = current->numberTableSize;
+		current->numberTable = NULL;
+		current->numberTableSize = 0;
+		if (!number_table_reset(current->numberArena.inUse)) {
+			out_of_memory(L"out of memory for numbers");
 		}
+		for (int j = 0; j < oldSize; j++) {
+			if (old[j]) {
+				number_table_insert(old[j]);
+			}
+		}
+		free(old);
+	}
+	number_table_insert(n);
+	return lisp_tagged(n, TAG_NUMBER);
+} // make_number
+
+LISPTR intern_number(const char* s)
+{
+	char* ep;
+	return make_number(strtod(s, &ep));
+}
+
+static void symbol_table_insert(SYMBOL* sym)
+{
+	unsigned i = string_hash(sym->name) & (current->symTableSize-1);
+	while (current->symTable[i]) {
+		i = (i + 1) & (current->symTableSize-1);
 	}
-	if (i == symCount) {
-		// Create a new symbol with name s
-		symCount++;
-		symPool[i].name = intern_string(s);
-		symPool[i].fnCell = NIL;
-		symPool[i].valueCell = NIL;
+	current->symTable[i] = sym;
+}
+
+static bool add_symbol_segment(void)
+{
+	if (!grow_array((void**)&current->symSegments, &current->symSegmentCapacity, current->symSegmentCount, sizeof(SYMBOL*))) {
+		return false;
 	}
-	return (LISPTR)&symPool[i];
+	SYMBOL* seg = (SYMBOL*)malloc(SYMBOLS_PER_SEGMENT * sizeof(SYMBOL));
+	if (!seg) {
+		return false;
+	}
+	current->symSegments[current->symSegmentCount++] = seg;
+	return true;
+}
+
+// Make room for one more symbol, growing the symbol table and
+// adding a symbol segment as needed.
+static bool reserve_symbol(void)
+{
+	if ((current->symCount + 1) * 2 > current->symTableSize) {
+		SYMBOL** old = current->symTable;
+		int oldSize = current->symTableSize;
+		current->symTable = (SYMBOL**)calloc(2 * oldSize, sizeof(SYMBOL*));
+		if (!current->symTable) {
+			current->symTable = old;
+			return false;
+		}
+		current->symTableSize = 2 * oldSize;
+		for (int i = 0; i < oldSize; i++) {
+			if (old[i]) {
+				symbol_table_insert(old[i]);
+			}
+		}
+		free(old);
+	}
+	if (current->symCount == current->symSegmentCount * SYMBOLS_PER_SEGMENT) {
+		return add_symbol_segment();
+	}
+	return true;
+} // reserve_symbol
+
+// Return the symbol named by the len bytes of UTF-8 at s, making it if need be.
+LISPTR intern_utf8(const char* s, int len)
+{
+	unsigned h = name_hash(s, len);
+	unsigned i = h & (current->symTableSize-1);
+	SYMBOL* sym;
+	while ((sym = current->symTable[i]) != NULL) {
+		const STRING_HEADER* name = string_header(sym->name);
+		if (name->hash == h && name->length == len && 0==memcmp(string_text(sym->name), s, len)) {
+			return lisp_tagged(sym, TAG_SYMBOL);
+		}
+		i = (i + 1) & (current->symTableSize-1);
+	}
+	if (!reserve_symbol()) {
+		out_of_memory(L"out of memory for symbols");
+	}
+	// Create a new symbol with name s
+	sym = SYMBOL_AT(current->symCount);
+	sym->name = NIL;
+	sym->fnCell = NIL;
+	sym->valueCell = NIL;
+	sym->index = current->symCount++;
+	sym->name = intern_string_utf8(s, len);
+	symbol_table_insert(sym);
+	return lisp_tagged(sym, TAG_SYMBOL);
+} // intern_utf8
+
+LISPTR intern(const wchar_t* s)
+{
+	return from_wide(s, intern_utf8);
 }
 
 const LISPTR symbol_name(LISPTR x)
@@ -314,7 +1189,7 @@ const LISPTR symbol_name(LISPTR x)
 	if (!symbolp(x)) {
 		return NIL;
 	}
-	return ((SYMBOL*)x)->name;
+	return SYMBOL_OF(x)->name;
 }
 
 LISPTR symbol_value(LISPTR x)
@@ -322,7 +1197,7 @@ LISPTR symbol_value(LISPTR x)
 	if (!symbolp(x)) {
 		return NIL;		// should be *UNBOUND* or something?
 	}
-	return ((SYMBOL*)x)->valueCell;
+	return SYMBOL_OF(x)->valueCell;
 }
 
 LISPTR symbol_function(LISPTR x)
@@ -330,7 +1205,17 @@ LISPTR symbol_function(LISPTR x)
 	if (!symbolp(x)) {
 		return NIL;		// should be *UNBOUND* or something?
 	}
-	return ((SYMBOL*)x)->fnCell;
+	return SYMBOL_OF(x)->fnCell;
+}
+
+LISPTR set_symbol_function(LISPTR x, LISPTR f)
+{
+	if (!symbolp(x)) {
+		lisp_error(L"set_symbol_function: not a symbol");
+		return NIL;
+	}
+	SYMBOL_OF(x)->fnCell = f;
+	return f;
 }
 
 // Compiled/native functions (SUBRs and FSUBRs)
@@ -339,7 +1224,7 @@ LISPTR def_fsubr(const wchar_t* name, NATIVE1ARGS fn)
 {
 	// make symbol
 	LISPTR x = intern(name);
-	((SYMBOL*)x)->fnCell = make_fsubr(fn);
+	SYMBOL_OF(x)->fnCell = make_fsubr(fn);
 	return x;
 } // def_fsubr
 
@@ -347,7 +1232,7 @@ LISPTR def_subr0(const wchar_t* name, NATIVE0ARGS fn)
 {
 	// make symbol
 	LISPTR x = intern(name);
-	((SYMBOL*)x)->fnCell = make_subr0(fn);
+	SYMBOL_OF(x)->fnCell = make_subr0(fn);
 	return x;
 } // def_subr0
 
@@ -355,7 +1240,7 @@ LISPTR def_subr1(const wchar_t* name, NATIVE1ARGS fn)
 {
 	// make symbol
 	LISPTR x = intern(name);
-	((SYMBOL*)x)->fnCell = make_subr1(fn);
+	SYMBOL_OF(x)->fnCell = make_subr1(fn);
 	return x;
 } // def_subr1
 
@@ -363,55 +1248,91 @@ LISPTR def_subr2(const wchar_t* name, NATIVE2ARGS fn)
 {
 	// make symbol
 	LISPTR x = intern(name);
-	((SYMBOL*)x)->fnCell = make_subr2(fn);
+	SYMBOL_OF(x)->fnCell = make_subr2(fn);
 	return x;
 } // def_subr2
 
-bool compiled_function_p(LISPTR x)
+static SUBR* alloc_subr(void)
 {
-	return x >= &subrPool[0] &&
-		   x < &subrPool[MAX_SUBRS];
+	if (current->subrCount == MAX_SUBRS) {
+		out_of_memory(L"out of SUBRs");
+	}
+	return &current->subrPool[current->subrCount++];
 }
 
 LISPTR make_fsubr(NATIVE1ARGS fn)
 {
-	SUBR* x = &subrPool[subrCount++];
+	SUBR* x = alloc_subr();
 	x->nargs = -1;
 	x->subr1 = fn;
-	return (LISPTR)x;
+	return lisp_tagged(x, TAG_SUBR);
 }
 
 LISPTR make_subr0(NATIVE0ARGS fn)
 {
-	SUBR* x = &subrPool[subrCount++];
+	SUBR* x = alloc_subr();
 	x->nargs = 0;
 	x->subr0 = fn;
-	return (LISPTR)x;
+	return lisp_tagged(x, TAG_SUBR);
 }
 
 LISPTR make_subr1(NATIVE1ARGS fn)
 {
-	SUBR* x = &subrPool[subrCount++];
+	SUBR* x = alloc_subr();
 	x->nargs = 1;
 	x->subr1 = fn;
-	return (LISPTR)x;
+	return lisp_tagged(x, TAG_SUBR);
 }
 
 LISPTR make_subr2(NATIVE2ARGS fn)
 {
-	SUBR* x = &subrPool[subrCount++];
+	SUBR* x = alloc_subr();
 	x->nargs = 2;
 	x->subr2 = fn;
-	return (LISPTR)x;
+	return lisp_tagged(x, TAG_SUBR);
 }
 
+// true if x is a SUBR that takes its arguments unevaluated
+bool fsubrp(LISPTR x)
+{
+	return compiled_function_p(x) && SUBR_OF(x)->nargs == -1;
+}
+
+// Call SUBR f with n arguments that have already been evaluated.
+// Missing arguments are NIL and extra ones are ignored.
+LISPTR call_subr(LISPTR f, LISPTR* args, int n)
+{
+	if (!compiled_function_p(f)) {
+		lisp_error(L"call_subr called with non-SUBR");
+		return NIL;
+	}
+	SUBR* cfp = SUBR_OF(f);
+	LISPTR a[3];
+	for (int i = 0; i < 3; i++) {
+		a[i] = (i < n) ? args[i] : NIL;
+	}
+	switch (cfp->nargs) {
+	case 0:
+		return cfp->subr0();
+	case 1:
+		return cfp->subr1(a[0]);
+	case 2:
+		return cfp->subr2(a[0], a[1]);
+	case 3:
+		return cfp->subr3(a[0], a[1], a[2]);
+	default:
+		lisp_error(L"call_subr called with an FSUBR");
+		return NIL;
+	} // switch
+} // call_subr
+
 LISPTR call_compiled_fn(LISPTR f, LISPTR args)
 {
 	LISPTR v = NIL;
 	if (!compiled_function_p(f)) {
 		lisp_error(L"call_compiled_fn called with non-SUBR");
 	} else {
-		SUBR* cfp = (SUBR*)f;
+		SUBR* cfp = SUBR_OF(f);
 		switch (cfp->nargs) {
 		case -1:
 			v = cfp->fsubr(args);
@@ -434,4 +1355,731 @@ LISPTR call_compiled_fn(LISPTR f, LISPTR args)
 		} // switch
 	}
 	return v;
-}
\ No newline at end of file
+}
+// Garbage collection
+//
+// Cells, numbers and strings are reclaimed by a mark-sweep collector that
+// runs whenever one of their pools is exhausted. Symbols and SUBRs are
+// permanent. The roots are the symbols, the registered root variables,
+// whatever the registered markers mark, and every word on the C stack
+// between the collector and the stack base. The stack is scanned
+// conservatively - any word that looks like a pointer to a live object
+// keeps it - so objects are never moved.
+
+#if defined(_MSC_VER)
+#define GC_NO_SANITIZE __declspec(no_sanitize_address)
+#elif defined(__GNUC__)
+#define GC_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define GC_NO_SANITIZE
+#endif
+
+void lisp_gc_stack_base(void* base)
+{
+	stackBase = base;
+}
+
+void lisp_gc_add_root(LISPTR* root)
+{
+	if (current->gcRootCount == MAX_GC_ROOTS) {
+		lisp_error(L"too many GC roots");
+		return;
+	}
+	current->gcRoots[current->gcRootCount++] = root;
+}
+
+void lisp_gc_add_marker(LISP_GC_MARKER fn)
+{
+	for (int i = 0; i < current->gcMarkerCount; i++) {
+		if (current->gcMarkers[i] == fn) {
+			return;
+		}
+	}
+	if (current->gcMarkerCount == MAX_GC_MARKERS) {
+		lisp_error(L"too many GC markers");
+		return;
+	}
+	current->gcMarkers[current->gcMarkerCount++] = fn;
+}
+
+// Mark x and everything reachable from it.
+// Recurses down the cars and loops down the cdrs, so long lists are cheap.
+void lisp_gc_mark(LISPTR x)
+{
+	while (true) {
+		switch (lisp_tag(x)) {
+		case TAG_CELL: {
+			CELL* c = CELL_OF(x);
+			SEGMENT* seg = SEGMENT_OF(c);
+			int i = (int)(c - (CELL*)SEGMENT_BASE(seg));
+			if (c->car == FREE_CELL || BIT_TEST(seg->marks, i)) {
+				return;
+			}
+			BIT_SET(seg->marks, i);
+#ifdef LISP_COMPACT_CELLS
+			wide_mark(c->car);
+			wide_mark(c->cdr);
+#endif
+			lisp_gc_mark(CELL_PTR(c->car));
+			x = CELL_PTR(c->cdr);
+			break;
+		}
+		case TAG_NUMBER: {
+			NUMBER* n = NUMBER_OF(x);
+			SEGMENT* seg = SEGMENT_OF(n);
+			BIT_SET(seg->marks, (int)(n - (NUMBER*)SEGMENT_BASE(seg)));
+			return;
+		}
+		case TAG_STRING: {
+			const STRING_HEADER* text = (const STRING_HEADER*)string_text(x);
+			SEGMENT* seg = SEGMENT_OF(text);
+			BIT_SET(seg->marks, (int)(text - (STRING_HEADER*)SEGMENT_BASE(seg)));
+			return;
+		}
+		default:
+			return;
+		} // switch
+	}
+} // lisp_gc_mark
+
+// Mark the object, if any, that p points to or into.
+// p might be any word off the stack, so it has to be checked against
+// the segments of the heap.
+static void gc_mark_address(void* p)
+{
+	SEGMENT* seg = SEGMENT_OF(p);
+	int lo = 0, hi = current->allSegmentCount;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (current->allSegments[mid] < seg) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == current->allSegmentCount || current->allSegments[lo] != seg) {
+		return;
+	}
+	ARENA* a = seg->arena;
+	char* base = SEGMENT_BASE(seg);
+	if ((char*)p < base) {
+		return;
+	}
+	int i = (int)(((char*)p - base) / a->size);
+	if (a == &current->stringArena) {
+		// only pointers to the start of a string count
+		if (i < seg->used && BIT_TEST(seg->starts, i)) {
+			lisp_gc_mark(lisp_tagged(base + i * a->size, TAG_STRING));
+		}
+	} else if (i < seg->used) {
+		lisp_gc_mark(lisp_tagged(base + i * a->size, (a == &current->cellArena) ? TAG_CELL : TAG_NUMBER));
+	}
+} // gc_mark_address
+
+// Mark whatever the words on the C stack might point to,
+// from here up to the stack base.
+GC_NO_SANITIZE static void gc_mark_stack(void)
+{
+	jmp_buf regs;
+	setjmp(regs);				// spill any registers holding pointers
+#if defined(__GNUC__)
+	__builtin_unwind_init();	// glibc's setjmp scrambles the frame pointer
+#endif
+	if (!stackBase) {
+		return;
+	}
+	char* lo = (char*)&regs;
+	char* hi = (char*)stackBase;
+	if (lo > hi) {
+		char* t = lo; lo = hi; hi = t;
+	}
+	lo = (char*)(((size_t)lo + sizeof(void*) - 1) & ~(sizeof(void*) - 1));
+	for (void** p = (void**)lo; (char*)(p + 1) <= hi; p++) {
+		gc_mark_address(*p);
+	}
+} // gc_mark_stack
+
+static void gc_sweep_strings(SEGMENT* seg)
+{
+	STRING_HEADER* pool = (STRING_HEADER*)SEGMENT_BASE(seg);
+	int run = -1;				// start of the current run of free blocks
+	int i = 0;
+	while (i <= seg->used) {
+		bool isFree = false;
+		int size = 0;
+		if (i < seg->used) {
+			size = pool[i].block & STRING_BLOCK_MAX;
+			isFree = (pool[i].block & STRING_FREE) != 0;
+			if (!isFree) {
+				if (BIT_TEST(seg->marks, i+1)) {
+					BIT_CLEAR(seg->marks, i+1);
+					current->stringArena.inUse += size;
+				} else {
+					BIT_CLEAR(seg->starts, i+1);
+					isFree = true;
+				}
+			}
+		}
+		if (isFree) {
+			if (run < 0) {
+				run = i;
+			}
+		} else if (run >= 0) {
+			if (i == seg->used) {
+				// trailing hole goes back to the end of the segment
+				seg->used = run;
+				break;
+			}
+			// coalesce the run into as few holes as will fit in a header
+			while (run < i) {
+				int n = i - run;
+				if (n > STRING_BLOCK_MAX) {
+					n = STRING_BLOCK_MAX;
+				}
+				pool[run].block = (unsigned short)(STRING_FREE | n);
+				run += n;
+			}
+			run = -1;
+		}
+		if (i == seg->used) {
+			break;
+		}
+		i += size;
+	}
+} // gc_sweep_strings
+
+static void gc_sweep_cells(SEGMENT* seg)
+{
+	CELL* cells = (CELL*)SEGMENT_BASE(seg);
+	for (int i = seg->used-1; i >= 0; i--) {
+		if (BIT_TEST(seg->marks, i)) {
+			BIT_CLEAR(seg->marks, i);
+			current->cellArena.inUse++;
+		} else {
+			free_cell(&cells[i]);
+		}
+	}
+}
+
+static void gc_sweep_numbers(SEGMENT* seg)
+{
+	NUMBER* numbers = (NUMBER*)SEGMENT_BASE(seg);
+	for (int i = seg->used-1; i >= 0; i--) {
+		if (BIT_TEST(seg->marks, i)) {
+			BIT_CLEAR(seg->marks, i);
+			current->numberArena.inUse++;
+			number_table_insert(&numbers[i]);
+		} else {
+			numbers[i].next = current->freeNumbers;
+			current->freeNumbers = &numbers[i];
+		}
+	}
+}
+
+void lisp_gc(void)
+{
+	current->gcCount++;
+	// mark
+#ifdef LISP_COMPACT_CELLS
+	current->wideMarks = (unsigned*)calloc(BITMAP_WORDS(current->wideCount) + 1, sizeof(unsigned));
+#endif
+	for (int i = 0; i < current->symCount; i++) {
+		SYMBOL* sym = SYMBOL_AT(i);
+		lisp_gc_mark(sym->name);
+		lisp_gc_mark(sym->valueCell);
+		lisp_gc_mark(sym->fnCell);
+	}
+	for (int i = 0; i < current->gcRootCount; i++) {
+		lisp_gc_mark(*current->gcRoots[i]);
+	}
+	for (int i = 0; i < current->gcMarkerCount; i++) {
+		current->gcMarkers[i]();
+	}
+	gc_mark_stack();
+	// sweep, newest segments last on the free lists
+	current->freeCells = NULL;
+	current->cellArena.inUse = 0;
+	for (int i = current->cellArena.segmentCount-1; i >= 0; i--) {
+		SEGMENT* seg = current->cellArena.segments[i];
+		if (seg->region) {
+			// region cells aren't collected, they go when the region ends
+			memset(seg->marks, 0, BITMAP_WORDS(seg->used) * sizeof(unsigned));
+		} else {
+			gc_sweep_cells(seg);
+		}
+	}
+	// the number table doesn't keep numbers alive: it's refilled with the survivors
+	if (!number_table_reset(current->numberArena.inUse)) {
+		memset(current->numberTable, 0, current->numberTableSize * sizeof(NUMBER*));
+	}
+	current->freeNumbers = NULL;
+	current->numberArena.inUse = 0;
+	for (int i = current->numberArena.segmentCount-1; i >= 0; i--) {
+		gc_sweep_numbers(current->numberArena.segments[i]);
+	}
+	current->stringArena.inUse = 0;
+	for (int i = 0; i < current->stringArena.segmentCount; i++) {
+		gc_sweep_strings(current->stringArena.segments[i]);
+	}
+#ifdef LISP_COMPACT_CELLS
+	wide_sweep();
+#endif
+} // lisp_gc
+
+static void arena_room(FILE* out, ARENA* a)
+{
+	fprintf(out, "--%s: %d in use, peak %d, %d segment(s) of %d\n",
+		a->name, a->inUse, a->peak, a->segmentCount, a->capacity);
+}
+
+// Report the size and high-water mark of each part of the heap.
+void lisp_room(FILE* out)
+{
+	arena_room(out, &current->cellArena);
+	arena_room(out, &current->numberArena);
+	arena_room(out, &current->stringArena);
+	fprintf(out, "--symbols: %d in %d segment(s) of %d\n", current->symCount, current->symSegmentCount, SYMBOLS_PER_SEGMENT);
+	fprintf(out, "--subrs: %d of %d\n", current->subrCount, MAX_SUBRS);
+	fprintf(out, "--region: %d segment(s), peak %d cells\n", current->regionSegmentCount, current->regionPeak);
+#ifdef LISP_COMPACT_CELLS
+	fprintf(out, "--wide cell references: %d, %d free\n", current->wideCount, current->wideFreeCount);
+#endif
+	fprintf(out, "--collections: %d\n", current->gcCount);
+}
+
+int lisp_gc_count(void)
+{
+	return current->gcCount;
+}
+
+// Heap images
+//
+// An image holds the code, then the segments of each arena, then the
+// symbols. A segment is saved as its used count, a bitmap and its
+// objects. The bitmap marks its free cells or numbers, or for strings,
+// where each string starts. Cells are saved as a pair of LISP_IMAGE_REFs,
+// the same size as a cell, so loading reads them straight into new
+// segments and relocates them in place. SUBRs aren't saved: the process
+// loading the image has made the same ones. Images aren't saved while a
+// region is open, so the region's segments are empty: their used count
+// is saved as -1 to tell them apart.
+//
+// A reference to a cell, number or string is its segment's index and
+// its offset in the segment, tag included. Symbols, SUBRs, code and
+// foreign objects are referred to by number, shifted up past the tag.
+// A fixnum is its own reference.
+
+typedef struct {
+	char	magic[8];
+	int		version;
+	int		pointerSize;
+	int		segmentSize;
+	int		symbolCount;
+	int		subrCount;
+} IMAGE_HEADER;
+
+static const char imageMagic[8] = { 'I', 'S', 'A', 'C', 'T', 'R', 'L', 'H' };
+
+void lisp_image_foreign(LISP_FOREIGN_INDEX index, LISP_FOREIGN_AT at)
+{
+	current->foreignIndex = index;
+	current->foreignAt = at;
+}
+
+LISP_IMAGE_REF lisp_image_ref(LISPTR x)
+{
+	switch (lisp_tag(x)) {
+	case TAG_CELL:
+	case TAG_NUMBER:
+	case TAG_STRING:
+		return ((LISP_IMAGE_REF)SEGMENT_OF(x)->index << SEGMENT_SHIFT) | ((uintptr_t)x & (SEGMENT_SIZE-1));
+	case TAG_SYMBOL:
+		return ((uintptr_t)SYMBOL_OF(x)->index << 3) | TAG_SYMBOL;
+	case TAG_SUBR:
+		return ((uintptr_t)(SUBR_OF(x) - current->subrPool) << 3) | TAG_SUBR;
+	case TAG_CODE: {
+		int i = lisp_code_index(x);
+		if (i >= 0) {
+			return ((uintptr_t)i << 3) | TAG_CODE;
+		}
+		break;
+	}
+	case TAG_FIXNUM:
+		return (LISP_IMAGE_REF)x;
+	case TAG_FOREIGN:
+		if (x == NULL) {
+			return 0;
+		}
+		if (current->foreignIndex) {
+			uintptr_t n = current->foreignIndex(x);
+			if (n > 0) {
+				return (n << 3) | TAG_FOREIGN;
+			}
+		}
+		break;
+	} // switch
+	lisp_error(L"object can't be saved in an image");
+	return TAG_SYMBOL;			// NIL
+} // lisp_image_ref
+
+LISPTR lisp_image_ptr(LISP_IMAGE_REF ref)
+{
+	uintptr_t n = ref >> 3;
+	ARENA* a = NULL;
+	switch ((unsigned)(ref & LISP_TAG_MASK)) {
+	case TAG_CELL:
+		a = &current->cellArena;
+		break;
+	case TAG_NUMBER:
+		a = &current->numberArena;
+		break;
+	case TAG_STRING:
+		a = &current->stringArena;
+		break;
+	case TAG_SYMBOL:
+		if (n < (uintptr_t)current->symCount) {
+			return lisp_tagged(SYMBOL_AT(n), TAG_SYMBOL);
+		}
+		break;
+	case TAG_SUBR:
+		if (n < (uintptr_t)current->subrCount) {
+			return lisp_tagged(&current->subrPool[n], TAG_SUBR);
+		}
+		break;
+	case TAG_CODE: {
+		LISPTR code = lisp_code_at((int)n);
+		if (code != NIL) {
+			return code;
+		}
+		break;
+	}
+	case TAG_FIXNUM:
+		return (LISPTR)ref;
+	case TAG_FOREIGN:
+		if (ref == 0) {
+			return NULL;
+		}
+		if (current->foreignAt) {
+			return current->foreignAt(n);
+		}
+		break;
+	} // switch
+	if (a) {
+		uintptr_t i = ref >> SEGMENT_SHIFT;
+		if (i < (uintptr_t)a->segmentCount) {
+			return (LISPTR)((char*)a->segments[i] + (ref & (SEGMENT_SIZE-1)));
+		}
+	}
+	lisp_error(L"bad reference in image");
+	return NIL;
+} // lisp_image_ptr
+
+static bool image_write(FILE* out, const void* p, size_t n)
+{
+	return fwrite(p, 1, n, out) == n;
+}
+
+static bool image_read(FILE* in, void* p, size_t n)
+{
+	return fread(p, 1, n, in) == n;
+}
+
+static bool save_arena(FILE* out, ARENA* a)
+{
+	bool ok = image_write(out, &a->segmentCount, sizeof(int)) &&
+			  image_write(out, &a->inUse, sizeof(int)) &&
+			  image_write(out, &a->peak, sizeof(int));
+	size_t bitmapSize = BITMAP_WORDS(a->capacity) * sizeof(unsigned);
+	unsigned* bits = (unsigned*)malloc(bitmapSize);
+	LISP_IMAGE_REF* refs = NULL;
+	if (a == &current->cellArena) {
+		refs = (LISP_IMAGE_REF*)malloc(a->capacity * 2 * sizeof(LISP_IMAGE_REF));
+		ok = ok && refs;
+	}
+	ok = ok && bits;
+	if (ok && a == &current->numberArena) {
+		// the mark bits are clear between collections: borrow them
+		// to find the free numbers
+		for (NUMBER* n = current->freeNumbers; n; n = (NUMBER*)n->next) {
+			SEGMENT* seg = SEGMENT_OF(n);
+			BIT_SET(seg->marks, (int)(n - (NUMBER*)SEGMENT_BASE(seg)));
+		}
+	}
+	for (int k = 0; ok && k < a->segmentCount; k++) {
+		SEGMENT* seg = a->segments[k];
+		const void* data = SEGMENT_BASE(seg);
+		size_t dataSize = seg->used * a->size;
+		if (a == &current->stringArena) {
+			memcpy(bits, seg->starts, bitmapSize);
+		} else if (a == &current->numberArena) {
+			memcpy(bits, seg->marks, bitmapSize);
+			memset(seg->marks, 0, bitmapSize);
+		} else {
+			memset(bits, 0, bitmapSize);
+			CELL* cells = (CELL*)SEGMENT_BASE(seg);
+			for (int i = 0; i < seg->used; i++) {
+				if (cells[i].car == FREE_CELL) {
+					BIT_SET(bits, i);
+					refs[2*i] = refs[2*i+1] = 0;
+				} else {
+					refs[2*i] = lisp_image_ref(CELL_PTR(cells[i].car));
+					refs[2*i+1] = lisp_image_ref(CELL_PTR(cells[i].cdr));
+				}
+			}
+			data = refs;
+			dataSize = seg->used * 2 * sizeof(LISP_IMAGE_REF);
+		}
+		int used = seg->region ? -1 : seg->used;
+		ok = image_write(out, &used, sizeof(int)) &&
+			 image_write(out, bits, bitmapSize) &&
+			 image_write(out, data, dataSize);
+	}
+	free(bits);
+	free(refs);
+	return ok;
+} // save_arena
+
+// Save the heap to an image. Collect garbage first to keep it small.
+bool lisp_save_image(FILE* out)
+{
+	if (current->regionOpen) {
+		lisp_error(L"can't save an image while a region is open");
+		return false;
+	}
+	IMAGE_HEADER h;
+	memcpy(h.magic, imageMagic, sizeof h.magic);
+	h.version = IMAGE_VERSION;
+	h.pointerSize = sizeof(LISPTR);
+	h.segmentSize = SEGMENT_SIZE;
+	h.symbolCount = current->symCount;
+	h.subrCount = current->subrCount;
+	bool ok = image_write(out, &h, sizeof h) &&
+			  lisp_save_code(out) &&
+			  save_arena(out, &current->cellArena) &&
+			  save_arena(out, &current->numberArena) &&
+			  save_arena(out, &current->stringArena);
+	for (int i = 0; ok && i < current->symCount; i++) {
+		SYMBOL* sym = SYMBOL_AT(i);
+		LISP_IMAGE_REF refs[3] = {
+			lisp_image_ref(sym->name),
+			lisp_image_ref(sym->valueCell),
+			lisp_image_ref(sym->fnCell)
+		};
+		ok = image_write(out, refs, sizeof refs);
+	}
+	return ok;
+} // lisp_save_image
+
+// Read an arena's segments from an image into new segments.
+// The bitmaps go in the segments' mark bits, or for strings, their start bits.
+// Saved cells are read into the segment, to be relocated in place, except
+// that compact cells are too small for them: then they are read into
+// stagedCells, one array per segment.
+#ifdef LISP_COMPACT_CELLS
+static LISP_THREAD LISP_IMAGE_REF** stagedCells;
+#endif
+
+static bool load_arena(FILE* in, ARENA* a)
+{
+	int count;
+	if (!image_read(in, &count, sizeof count) ||
+		!image_read(in, &a->inUse, sizeof(int)) ||
+		!image_read(in, &a->peak, sizeof(int))) {
+		return false;
+	}
+	size_t bitmapSize = BITMAP_WORDS(a->capacity) * sizeof(unsigned);
+	for (int k = 0; k < count; k++) {
+		if (!arena_add_segment(a)) {
+			return false;
+		}
+		SEGMENT* seg = a->segments[k];
+		if (!image_read(in, &seg->used, sizeof(int))) {
+			return false;
+		}
+		if (seg->used == -1 && a == &current->cellArena) {
+			// a segment of the region, empty between regions
+			seg->used = 0;
+			seg->region = true;
+			if (!grow_array((void**)&current->regionSegments, &current->regionSegmentCapacity, current->regionSegmentCount, sizeof(SEGMENT*))) {
+				return false;
+			}
+			current->regionSegments[current->regionSegmentCount++] = seg;
+		} else {
+			a->bump = k;
+		}
+		if (seg->used < 0 || seg->used > a->capacity ||
+			!image_read(in, (a == &current->stringArena) ? seg->starts : seg->marks, bitmapSize)) {
+			return false;
+		}
+		void* data = SEGMENT_BASE(seg);
+		size_t dataSize = seg->used * a->size;
+		if (a == &current->cellArena) {
+			dataSize = seg->used * 2 * sizeof(LISP_IMAGE_REF);
+#ifdef LISP_COMPACT_CELLS
+			LISP_IMAGE_REF** staged = (LISP_IMAGE_REF**)realloc(stagedCells, (k+1) * sizeof(LISP_IMAGE_REF*));
+			if (!staged) {
+				return false;
+			}
+			stagedCells = staged;
+			data = stagedCells[k] = (LISP_IMAGE_REF*)malloc(dataSize ? dataSize : 1);
+			if (!data) {
+				return false;
+			}
+#endif
+		}
+		if (!image_read(in, data, dataSize)) {
+			return false;
+		}
+	}
+	return true;
+} // load_arena
+
+// Replace the heap with the one saved in an image.
+bool lisp_load_image(FILE* in)
+{
+	IMAGE_HEADER h;
+	if (!image_read(in, &h, sizeof h) ||
+		memcmp(h.magic, imageMagic, sizeof h.magic) != 0 ||
+		h.version != IMAGE_VERSION ||
+		h.pointerSize != sizeof(LISPTR) ||
+		h.segmentSize != SEGMENT_SIZE) {
+		lisp_error(L"not a heap image for this build");
+		return false;
+	}
+	if (h.subrCount != current->subrCount || h.symbolCount < current->symCount) {
+		lisp_error(L"heap image was saved by a different build");
+		return false;
+	}
+	// the symbols we have must be the first ones in the image
+	int startCount = current->symCount;
+	unsigned* startNames = (unsigned*)malloc((startCount+1) * sizeof(unsigned));
+	if (!startNames) {
+		return false;
+	}
+	for (int i = 0; i < startCount; i++) {
+		startNames[i] = string_hash(SYMBOL_AT(i)->name);
+	}
+	// throw away the heap we have
+	arena_release(&current->cellArena);
+	arena_release(&current->numberArena);
+	arena_release(&current->stringArena);
+	current->allSegmentCount = 0;
+	current->freeCells = NULL;
+	current->freeNumbers = NULL;
+#ifdef LISP_COMPACT_CELLS
+	wide_reset();
+	free(stagedCells);
+	stagedCells = NULL;
+#endif
+	while (current->symSegmentCount * SYMBOLS_PER_SEGMENT < h.symbolCount) {
+		if (!add_symbol_segment()) {
+			free(startNames);
+			return false;
+		}
+	}
+	current->symCount = h.symbolCount;
+	bool ok = lisp_load_code(in) &&
+			  load_arena(in, &current->cellArena) &&
+			  load_arena(in, &current->numberArena) &&
+			  load_arena(in, &current->stringArena);
+	for (int i = 0; ok && i < current->symCount; i++) {
+		SYMBOL* sym = SYMBOL_AT(i);
+		LISP_IMAGE_REF refs[3];
+		ok = image_read(in, refs, sizeof refs);
+		sym->name = (LISPTR)refs[0];
+		sym->valueCell = (LISPTR)refs[1];
+		sym->fnCell = (LISPTR)refs[2];
+		sym->index = i;
+	}
+	if (!ok) {
+		free(startNames);
+		lisp_error(L"heap image is incomplete");
+		return false;
+	}
+	// relocate
+	for (int k = 0; k < current->cellArena.segmentCount; k++) {
+		SEGMENT* seg = current->cellArena.segments[k];
+		CELL* cells = (CELL*)SEGMENT_BASE(seg);
+#ifdef LISP_COMPACT_CELLS
+		LISP_IMAGE_REF* refs = stagedCells[k];
+#else
+		LISP_IMAGE_REF* refs = (LISP_IMAGE_REF*)cells;
+#endif
+		for (int i = 0; i < seg->used; i++) {
+			if (!BIT_TEST(seg->marks, i)) {
+				LISPTR a = lisp_image_ptr(refs[2*i]);
+				LISPTR d = lisp_image_ptr(refs[2*i+1]);
+				cells[i].car = CELL_REF(a);
+				cells[i].cdr = CELL_REF(d);
+			}
+		}
+#ifdef LISP_COMPACT_CELLS
+		free(refs);
+#endif
+	}
+#ifdef LISP_COMPACT_CELLS
+	free(stagedCells);
+	stagedCells = NULL;
+#endif
+	for (int i = 0; i < current->symCount; i++) {
+		SYMBOL* sym = SYMBOL_AT(i);
+		sym->name = lisp_image_ptr((LISP_IMAGE_REF)sym->name);
+		sym->valueCell = lisp_image_ptr((LISP_IMAGE_REF)sym->valueCell);
+		sym->fnCell = lisp_image_ptr((LISP_IMAGE_REF)sym->fnCell);
+	}
+	lisp_relocate_code();
+	for (int i = 0; i < startCount; i++) {
+		SYMBOL* sym = SYMBOL_AT(i);
+		if (!stringp(sym->name) || string_hash(sym->name) != startNames[i]) {
+			ok = false;
+		}
+	}
+	free(startNames);
+	if (!ok) {
+		lisp_error(L"heap image was saved by a different build");
+		return false;
+	}
+	// rebuild the free lists, newest segments last as after a collection
+	for (int k = current->cellArena.segmentCount-1; k >= 0; k--) {
+		SEGMENT* seg = current->cellArena.segments[k];
+		CELL* cells = (CELL*)SEGMENT_BASE(seg);
+		for (int i = seg->used-1; i >= 0; i--) {
+			if (BIT_TEST(seg->marks, i)) {
+				BIT_CLEAR(seg->marks, i);
+				free_cell(&cells[i]);
+			}
+		}
+	}
+	if (!number_table_reset(current->numberArena.inUse)) {
+		return false;
+	}
+	for (int k = current->numberArena.segmentCount-1; k >= 0; k--) {
+		SEGMENT* seg = current->numberArena.segments[k];
+		NUMBER* numbers = (NUMBER*)SEGMENT_BASE(seg);
+		for (int i = seg->used-1; i >= 0; i--) {
+			if (BIT_TEST(seg->marks, i)) {
+				BIT_CLEAR(seg->marks, i);
+				numbers[i].next = current->freeNumbers;
+				current->freeNumbers = &numbers[i];
+			} else {
+				number_table_insert(&numbers[i]);
+			}
+		}
+	}
+	// and index the symbols by name
+	int size = MIN_SYMBOL_TABLE;
+	while (size < 2 * (current->symCount+1)) {
+		size *= 2;
+	}
+	SYMBOL** table = (SYMBOL**)calloc(size, sizeof(SYMBOL*));
+	if (!table) {
+		return false;
+	}
+	free(current->symTable);
+	current->symTable = table;
+	current->symTableSize = size;
+	for (int i = 0; i < current->symCount; i++) {
+		symbol_table_insert(SYMBOL_AT(i));
+	}
+	return true;
+} // lisp_load_image
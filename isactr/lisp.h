@@ -2,17 +2,51 @@
 #define LISP_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 typedef void *LISPTR;		// Lisp pointer
 
-const extern LISPTR NIL;	// Lispy null, also false.
-const extern LISPTR T;		// Lispy TRUE
-const extern LISPTR QUOTE;	// symbol named QUOTE
-const extern LISPTR FUNCTION;
-const extern LISPTR LAMBDA;
+// The low 3 bits of a LISPTR give its type. Lisp objects are 8-byte
+// aligned, so the tag is simply added to the object's address.
+// Tag 0 is a plain C pointer (a chunk, say) that Lisp can pass around
+// but doesn't look inside. Integers small enough are held in the
+// LISPTR itself as fixnums, the value shifted up past the tag.
+#define LISP_TAG_MASK	7
+#define TAG_FOREIGN		0
+#define TAG_CELL		1
+#define TAG_SYMBOL		2
+#define TAG_STRING		3
+#define TAG_NUMBER		4		// boxed double
+#define TAG_FIXNUM		5		// so (tag & 6) == 4 for all numbers
+#define TAG_SUBR		6
+#define TAG_CODE		7		// compiled LAMBDA
+
+#define FIXNUM_MAX		(INTPTR_MAX / 8)
+#define FIXNUM_MIN		(-FIXNUM_MAX)
+#define fixnum_value(x)	(((intptr_t)(x) - TAG_FIXNUM) / 8)
+
+#define lisp_tag(x)				((unsigned)((uintptr_t)(x) & LISP_TAG_MASK))
+#define lisp_tagged(p, tag)		((LISPTR)((char*)(p) + (tag)))
+#define lisp_untagged(x, tag)	((void*)((char*)(x) - (tag)))
+
+// Storage of which each thread has its own copy.
+#if defined(_MSC_VER)
+#define LISP_THREAD __declspec(thread)
+#else
+#define LISP_THREAD __thread
+#endif
+
+// These belong to the current Lisp (see lisp_switch).
+extern LISP_THREAD LISPTR NIL;		// Lispy null, also false.
+extern LISP_THREAD LISPTR T;		// Lispy TRUE
+extern LISP_THREAD LISPTR QUOTE;	// symbol named QUOTE
+extern LISP_THREAD LISPTR FUNCTION;
+extern LISP_THREAD LISPTR LAMBDA;
 
 void lisp_init(void);
 void lisp_shutdown(void);
+void init_lisp_eval(void);
+void lisp_shutdown_eval(void);
 
 // Read and return the next S-expression from a file
 LISPTR lisp_read(FILE* in);
@@ -34,25 +68,75 @@ LISPTR caddr(LISPTR x);
 LISPTR cadddr(LISPTR x);
 LISPTR assoc(LISPTR item, LISPTR alist);
 LISPTR defvar(LISPTR x, LISPTR y);
-bool consp(LISPTR x);
-bool listp(LISPTR x);
-bool atomp(LISPTR x);
-bool symbolp(LISPTR x);
-bool stringp(LISPTR x);
-bool numberp(LISPTR x);
-bool eql(LISPTR x, LISPTR y);
+inline bool consp(LISPTR x)		{ return lisp_tag(x) == TAG_CELL; }
+inline bool listp(LISPTR x)		{ return x==NIL || consp(x); }
+inline bool atomp(LISPTR x)		{ return !consp(x); }
+inline bool symbolp(LISPTR x)	{ return lisp_tag(x) == TAG_SYMBOL; }
+inline bool stringp(LISPTR x)	{ return lisp_tag(x) == TAG_STRING; }
+inline bool numberp(LISPTR x)	{ return (lisp_tag(x) & 6) == TAG_NUMBER; }
+// Numbers are unique by value, so eql is just identity.
+inline bool eql(LISPTR x, LISPTR y)	{ return x == y; }
 LISPTR intern(const wchar_t* name);
+LISPTR intern_utf8(const char* name, int len);
 const LISPTR symbol_name(LISPTR x);
 LISPTR symbol_value(LISPTR x);
 LISPTR symbol_function(LISPTR x);
+LISPTR set_symbol_function(LISPTR x, LISPTR f);
 LISPTR eval(LISPTR x);
 LISPTR intern_string(const wchar_t* str);
-LISPTR intern_number(const wchar_t* str);
+LISPTR intern_string_utf8(const char* str, int len);
+LISPTR intern_number(const char* str);
+LISPTR make_number(double d);
 LISPTR progn(LISPTR x);
+LISPTR rplaca(LISPTR x, LISPTR y);		// returns modified x
 LISPTR rplacd(LISPTR x, LISPTR y);		// returns modified x
 LISPTR nconc(LISPTR x, LISPTR y);		// modifies x to end with y, returns x
-#define string_text(x) ((const wchar_t*)(x))
-#define number_value(x) (*(double*)(x))
+
+// Garbage collection.
+// The collector finds Lisp pointers held by C code by scanning the stack
+// from where it runs up to the stack base, normally the address of a
+// local or parameter of main, or of a thread's start function for a
+// Lisp run on another thread. Pointers held anywhere else - globals,
+// malloc'd structures - must be reachable from a registered root or be
+// marked by a registered marker function.
+typedef void (*LISP_GC_MARKER)(void);
+void lisp_gc_stack_base(void* base);
+void lisp_gc_add_root(LISPTR* root);
+void lisp_gc_add_marker(LISP_GC_MARKER fn);
+void lisp_gc_mark(LISPTR x);		// for use by markers
+void lisp_gc(void);
+int lisp_gc_count(void);			// collections so far
+void lisp_room(FILE* out);			// report heap use and high-water marks
+
+// Regions.
+// Between lisp_region_begin and lisp_region_end, cons takes its cells
+// from a region instead of the heap: one after another, never collected,
+// and all given back at once when the region ends. It's for runs of
+// work whose conses are all garbage by the end. Nothing consed in a
+// region may still be referred to after it ends. Regions don't nest, and
+// Lisps are only switched between them.
+void lisp_region_begin(void);
+void lisp_region_end(void);
+// A copy of x that can be kept after the region ends: the parts of it
+// consed in the region are copied to the heap, the rest is shared.
+LISPTR lisp_region_keep(LISPTR x);
+
+// Strings are UTF-8, 0-terminated, and know their length and hash.
+// Convert to wide characters only where wide output is really needed.
+typedef struct {
+	unsigned short	block;			// the heap's own use
+	unsigned short	length;			// bytes of text, not counting the 0
+	unsigned		hash;
+} LISP_STRING_HEADER;
+#define string_text(x) ((const char*)lisp_untagged(x, TAG_STRING))
+#define string_header(x) ((const LISP_STRING_HEADER*)string_text(x) - 1)
+inline int string_length(LISPTR x)		{ return string_header(x)->length; }
+inline unsigned string_hash(LISPTR x)	{ return string_header(x)->hash; }
+int utf8_encode(char* out, int c);		// returns bytes written, 1-4
+inline double number_value(LISPTR x)
+{
+	return lisp_tag(x) == TAG_FIXNUM ? (double)fixnum_value(x) : *(double*)lisp_untagged(x, TAG_NUMBER);
+}
 
 typedef LISPTR (*NATIVE0ARGS)();
 typedef LISPTR (*NATIVE1ARGS)(LISPTR);
@@ -64,12 +148,65 @@ LISPTR def_subr0(const wchar_t* name, NATIVE0ARGS fn);
 LISPTR def_subr1(const wchar_t* name, NATIVE1ARGS fn);
 LISPTR def_subr2(const wchar_t* name, NATIVE2ARGS fn);
 LISPTR def_subr3(const wchar_t* name, NATIVE3ARGS fn);
-bool compiled_function_p(LISPTR x);
+inline bool compiled_function_p(LISPTR x)	{ return lisp_tag(x) == TAG_SUBR; }
 LISPTR make_fsubr(NATIVE1ARGS fn);
 LISPTR make_subr0(NATIVE0ARGS fn);
 LISPTR make_subr1(NATIVE1ARGS fn);
 LISPTR make_subr2(NATIVE2ARGS fn);
 LISPTR make_subr3(NATIVE3ARGS fn);
 LISPTR call_compiled_fn(LISPTR f, LISPTR args);
+LISPTR call_subr(LISPTR f, LISPTR* args, int n);
+bool fsubrp(LISPTR x);
+
+// Bytecode.
+// LAMBDA bodies and top-level forms are compiled to bytecode for a
+// stack VM, with parameters in frame slots.
+inline bool codep(LISPTR x)	{ return lisp_tag(x) == TAG_CODE; }
+LISPTR lisp_compile(LISPTR name, LISPTR formals, LISPTR body);	// NIL on error
+LISPTR lisp_run(LISPTR code);					// call compiled code with no arguments
+
+// Heap images.
+// The whole heap can be saved to a file and loaded by a later run of the
+// same build instead of reading the model again. In the image, pointers
+// are LISP_IMAGE_REFs, which don't depend on where anything is in
+// memory. Foreign pointers are numbered by functions registered by
+// their owner: index(x) gives foreign object x a number > 0, and
+// at(n) finds it again when the image is loaded.
+// An image can only be loaded into a heap that has just been initialized
+// with the same symbols and SUBRs as when it was saved. If loading fails,
+// the heap is left unusable.
+typedef uintptr_t LISP_IMAGE_REF;
+typedef uintptr_t (*LISP_FOREIGN_INDEX)(LISPTR x);
+typedef LISPTR (*LISP_FOREIGN_AT)(uintptr_t n);
+void lisp_image_foreign(LISP_FOREIGN_INDEX index, LISP_FOREIGN_AT at);
+LISP_IMAGE_REF lisp_image_ref(LISPTR x);
+LISPTR lisp_image_ptr(LISP_IMAGE_REF ref);		// after lisp_load_image
+bool lisp_save_image(FILE* out);
+bool lisp_load_image(FILE* in);
+// compiled code in images, for lisp_save_image and lisp_load_image
+int lisp_code_index(LISPTR x);					// -1 if x isn't live code
+LISPTR lisp_code_at(int i);
+bool lisp_save_code(FILE* out);
+bool lisp_load_code(FILE* in);					// constants are left as LISP_IMAGE_REFs
+void lisp_relocate_code(void);
+
+// Lisp states.
+// A process can hold any number of Lisps, each with its own heap,
+// symbols, SUBRs, roots, markers, compiled code and reader. Each thread
+// has a current Lisp, which the lisp_ functions work on: lisp_init makes
+// a new one current, lisp_switch changes to another, and lisp_shutdown
+// frees the current one and leaves none. A Lisp may be current on only
+// one thread at a time, and only be switched away from at top level,
+// with none of its pointers on the stack: the collector only scans the
+// stack of the thread that runs it, from that thread's stack base.
+typedef struct _LISP_STATE LISP_STATE;
+LISP_STATE* lisp_current(void);			// NULL if none
+void lisp_switch(LISP_STATE* state);	// NULL for none
+// for lisp_init, lisp_switch and lisp_shutdown
+void* lisp_eval_create(void);			// NULL if out of memory
+void lisp_eval_switch(void* state);
+void* lisp_reader_create(void);			// NULL if out of memory
+void lisp_reader_switch(void* state);
+void lisp_reader_shutdown(void);
 
 #endif // LISP_H
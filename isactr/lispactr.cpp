@@ -9,8 +9,6 @@ LISPTR clear_all(void)
 	return NIL;
 }
 
-static LISPTR model_name;
-
 LISPTR sgp(LISPTR args)
 {
 	return SGP;
@@ -35,8 +33,7 @@ LISPTR add_dm(LISPTR args)
 static unsigned first_char(LISPTR x)
 {
 	if (symbolp(x)) {
-		const wchar_t* name = string_text(symbol_name(x));
-		return name[0];
+		return (unsigned char)string_text(symbol_name(x))[0];
 	}
 	return 0;
 }
@@ -45,8 +42,8 @@ static bool is_bufspec(LISPTR x)
 {
 	// It's a buffer-spec if it's a symbol whose last char is '>'
 	if (symbolp(x)) {
-		const wchar_t* name = string_text(symbol_name(x));
-		return name[wcslen(name)-1] == '>';
+		LISPTR name = symbol_name(x);
+		return string_text(name)[string_length(name)-1] == '>';
 	}
 	return false;
 }
@@ -59,8 +56,9 @@ static bool is_clause_start(LISPTR x)
 {
 	// It's a buffer-spec if it's a symbol whose last char is '>'
 	if (symbolp(x)) {
-		const wchar_t* name = string_text(symbol_name(x));
-		return name[wcslen(name)-1] == '>' || name[0]=='!';
+		LISPTR name = symbol_name(x);
+		const char* text = string_text(name);
+		return text[string_length(name)-1] == '>' || text[0]=='!';
 	}
 	return false;
 } // is_clause_start
@@ -93,52 +91,77 @@ static LISPTR make_binding(LISPTR var, LISPTR* pvars)
 	return binding;
 } // make_binding
 
+// Append x to the list whose first cell is *phead and last cell is *plast.
+static void append(LISPTR* phead, LISPTR* plast, LISPTR x)
+{
+	LISPTR cell = cons(x, NIL);
+	if (*phead == NIL) {
+		*phead = cell;
+	} else {
+		rplacd(*plast, cell);
+	}
+	*plast = cell;
+} // append
+
 // buffer-test ::= =buffer-name> isa chunk-type slot-test*
 // slot-test ::= {slot-modifier} slot-name slot-value
 // slot-modifier ::= [= | - | < | > | <= | >=]
 static LISPTR translate_slot_test_sequence(LISPTR p, LISPTR* pvars)
 {
-	if (!consp(p)) {
-		return p;
-	}
-	if (is_clause_start(car(p))) {
-		return NIL;						// start of new clause, end of test sequence
-	}
-	// default modifier is '='
-	LISPTR modifier = EQUALS;
-	LISPTR slotName = car(p);
-	LISPTR value = cadr(p);
-	p = cddr(p);
-	if (is_slot_modifier(slotName)) {
-		modifier = slotName;
-		slotName = value;
-		value = car(p); p = cdr(p);
-	}
-	// replace variables of the form =name with shared dotted pairs (<var>.NIL)
-	if (is_variable(value)) {
-		value = make_binding(value, pvars);
+	LISPTR tests = NIL, last = NIL;
+	while (consp(p)) {
+		if (is_clause_start(car(p))) {
+			return tests;				// start of new clause, end of test sequence
+		}
+		// default modifier is '='
+		LISPTR modifier = EQUALS;
+		LISPTR slotName = car(p);
+		LISPTR value = cadr(p);
+		p = cddr(p);
+		if (is_slot_modifier(slotName)) {
+			modifier = slotName;
+			slotName = value;
+			value = car(p); p = cdr(p);
+		}
+		// replace variables of the form =name with shared dotted pairs (<var>.NIL)
+		if (is_variable(value)) {
+			value = make_binding(value, pvars);
+		}
+		// Represent the test as a triplet (modifier slot-name value)
+		append(&tests, &last, cons(modifier, cons(slotName, cons(value, NIL))));
 	}
-	// Represent the test as a triplet (modifier slot-name value)
-	LISPTR test = cons(modifier, cons(slotName, cons(value, NIL)));
 	// Return the list of tests
-	return cons(test, translate_slot_test_sequence(p, pvars));
+	if (last == NIL) {
+		return p;
+	}
+	rplacd(last, p);
+	return tests;
 }
 
+// Copy the items of list p up to the next clause, replacing variables
+// with their bindings. Loops down the list, and only recurses into
+// items that are lists themselves.
 static LISPTR copy_test(LISPTR p, LISPTR* pvars)
 {
-	if (!consp(p)) {
-		return p;
-	}
-	LISPTR item = car(p);
-	if (is_clause_start(item)) {
-		return NIL;
+	LISPTR copy = NIL, last = NIL;
+	while (consp(p)) {
+		LISPTR item = car(p);
+		if (is_clause_start(item)) {
+			return copy;
+		}
+		if (is_variable(item)) {
+			item = make_binding(item, pvars);
+		} else if (consp(item)) {
+			item = copy_test(item, pvars);
+		}
+		append(&copy, &last, item);
+		p = cdr(p);
 	}
-	if (is_variable(item)) {
-		item = make_binding(item, pvars);
-	} else if (consp(item)) {
-		item = copy_test(item, pvars);
+	if (last == NIL) {
+		return p;
 	}
-	return cons(item, copy_test(cdr(p), pvars));
+	rplacd(last, p);
+	return copy;
 } // copy_test
 
 static LISPTR extract_buffer_name(LISPTR sym)
@@ -147,10 +170,9 @@ static LISPTR extract_buffer_name(LISPTR sym)
 		lisp_error(L"buffer-spec in production is not a symbol");
 		return NIL;
 	}
-	wchar_t bufname[128];
-	wcscpy_s(bufname, string_text(symbol_name(sym)));
-	bufname[wcslen(bufname)-1] = 0;
-	return intern(bufname+1);
+	// drop the leading =, + or ? and the trailing >
+	LISPTR name = symbol_name(sym);
+	return intern_utf8(string_text(name)+1, string_length(name)-2);
 } // extract_buffer_name
 
 static bool parse_condition(LISPTR* pp, LISPTR* pcond, LISPTR* pvars)
@@ -224,20 +246,24 @@ static bool parse_action(LISPTR* pp, LISPTR* pact, LISPTR* pvars)
 
 static bool parse_production(LISPTR p, LISPTR* plhs, LISPTR* prhs, LISPTR* pvars)
 {
+	LISPTR* pclauses = plhs;			// LHS until we pass the ==>
+	LISPTR last = NIL;					// last cell of *pclauses
 	while (consp(p)) {
 		// it's a list, it starts with either a right-arrow (==>)
 		// or a buffer-spec, like =goal>
 		if (car(p)==RIGHT_ARROW) {
-			if (!prhs) {
+			if (pclauses == prhs) {
 				lisp_error(L"2nd ==> in production??");
 				return false;
 			}
-			// recurse to parse right-hand side
-			// (tail recursion, could be flattened)
-			return parse_production(cdr(p), prhs, NULL, pvars);
+			// go on to parse right-hand side
+			pclauses = prhs;
+			last = NIL;
+			p = cdr(p);
+			continue;
 		}
 		LISPTR clause = NIL;
-		if (prhs) {
+		if (pclauses == plhs) {
 			// parse LHS
 			if (!parse_condition(&p, &clause, pvars)) {
 				return false;
@@ -249,14 +275,14 @@ static bool parse_production(LISPTR p, LISPTR* plhs, LISPTR* prhs, LISPTR* pvars
 			}
 		}
 		// parsed a clause, append to the LHS or RHS
-		*plhs = nconc(*plhs, cons(clause, NIL));
+		append(pclauses, &last, clause);
 	} // while parsing production
 	// end of production, check for syntax errors
 	if (p != NIL) {
 		lisp_error(L"junk at end of production");
 		return false;
 	}
-	if (prhs!=NULL) {
+	if (pclauses != prhs) {
 		lisp_error(L"didn't find ==> in production");
 		return false;
 	}
@@ -299,6 +325,7 @@ LISPTR goal_focus(LISPTR args)
 
 LISPTR define_model(LISPTR m)
 {
+	LISPTR model_name = NIL;
 	if (consp(m)) {
 		model_name = car(m); m = cdr(m);
 		while (consp(m)) {
@@ -333,10 +360,45 @@ LISPTR subr_run(LISPTR duration)
 	return NIL;
 } // subr_run
 
+// (CHECKPOINT name): save the model's state as name
+LISPTR subr_checkpoint(LISPTR name)
+{
+	if (!symbolp(name)) {
+		lisp_error(L"argument to CHECKPOINT is not a symbol");
+		return NIL;
+	}
+	return isactr_checkpoint(name) ? name : NIL;
+}
+
+// (RESTORE name): put the model back in the state saved as name
+LISPTR subr_restore(LISPTR name)
+{
+	if (!symbolp(name)) {
+		lisp_error(L"argument to RESTORE is not a symbol");
+		return NIL;
+	}
+	return isactr_restore(name) ? name : NIL;
+}
+
+// (ACT-R-RANDOM limit): a random number from 0 up to limit, from the
+// model's own random stream. An integer if limit is one.
+LISPTR act_r_random(LISPTR limit)
+{
+	if (!numberp(limit) || number_value(limit) <= 0) {
+		lisp_error(L"argument to ACT-R-RANDOM is not a positive number");
+		return NIL;
+	}
+	double r = isactr_random() * number_value(limit);
+	return make_number(lisp_tag(limit) == TAG_FIXNUM ? floor(r) : r);
+}
+
 void init_lisp_actr(void)
 {
 	def_fsubr(L"DEFINE-MODEL", define_model);
 	def_subr0(L"CLEAR-ALL", clear_all);
 	def_subr1(L"RUN", subr_run);
+	def_subr1(L"CHECKPOINT", subr_checkpoint);
+	def_subr1(L"RESTORE", subr_restore);
+	def_subr1(L"ACT-R-RANDOM", act_r_random);
 }
 
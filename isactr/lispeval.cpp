@@ -1,66 +1,711 @@
 #include "lisp.h"
+#include <stdlib.h>
+#include <string.h>
 
-static LISPTR lexvars = NIL;
+// Compiler and VM.
+//
+// A form is compiled into a CODE object: bytecode for a little stack
+// machine, plus a vector of the constants it uses. A function's
+// arguments are pushed on the VM stack and become the first slots of its
+// frame, so a variable reference is just an index - there is no
+// environment to search. Calls between compiled functions are handled
+// by the VM's own frame stack rather than by recursing in C.
+//
+// Variables are lexically scoped: a name that isn't a parameter of the
+// function being compiled refers to the symbol's global value.
 
-LISPTR bind_args(LISPTR formals, LISPTR acts, LISPTR prev)
+#define MAX_CODE_ARGS 255
+#define MAX_CODE_CONSTS 65535
+#define MAX_VM_FRAMES 100000		// deepest nesting of calls, to stop runaway recursion
+
+enum {
+	OP_CONST,			// k16			push constant k
+	OP_LOCAL,			// i8			push frame slot i
+	OP_GLOBAL,			// k16			push value of symbol constant k
+	OP_SETLOCAL,		// i8			frame slot i = top of stack
+	OP_SETGLOBAL,		// k16			value of symbol constant k = top of stack
+	OP_POP,				//				drop top of stack
+	OP_JUMP,			// d16			pc += d
+	OP_JUMPNIL,			// d16			pop, and if it was NIL, pc += d
+	OP_CALL,			// k16 n8		call the function of symbol constant k with the top n values
+	OP_CALLF,			// k16 m16		call the FSUBR of symbol constant k with constant m, unevaluated
+	OP_RETURN			//				return top of stack to the caller
+};
+
+typedef struct _CODE {
+	struct _CODE*	next;			// all live code, so the collector can see the constants
+	struct _CODE*	prev;
+	LISPTR			name;
+	int				nargs;			// parameters = frame slots
+	unsigned char*	bytes;
+	int				byteCount;
+	int				byteCapacity;
+	LISPTR*			consts;
+	int				constCount;
+	int				constCapacity;
+} CODE;
+
+typedef struct {
+	CODE*			code;
+	int				pc;
+	int				base;			// stack index of frame slot 0
+} FRAME;
+
+#define CODE_OF(x)	((CODE*)lisp_untagged(x, TAG_CODE))
+
+// The evaluator's part of a Lisp
+typedef struct {
+	CODE*			codeList;
+	LISPTR*			vmStack;
+	int				vmTop;			// index of the next free stack slot
+	int				vmCapacity;
+	FRAME*			vmFrames;
+	int				vmFrameCount;
+	int				vmFrameCapacity;
+	LISPTR			IF, PROGN, SETQ;
+} EVAL_STATE;
+
+static LISP_THREAD EVAL_STATE* ev;	// the current Lisp's
+
+// Make room in a malloc'd array for at least n more items.
+static bool reserve(void** items, int* capacity, int count, int n, size_t itemSize)
+{
+	if (count + n <= *capacity) {
+		return true;
+	}
+	int cap = *capacity ? *capacity : 64;
+	while (cap < count + n) {
+		cap *= 2;
+	}
+	void* p = realloc(*items, cap * itemSize);
+	if (!p) {
+		lisp_error(L"out of memory in the compiler/VM");
+		return false;
+	}
+	*items = p;
+	*capacity = cap;
+	return true;
+} // reserve
+
+///////////////////////////////////////////////////////////////////////
+// code objects
+
+static CODE* new_code(LISPTR name, int nargs)
+{
+	CODE* c = (CODE*)calloc(1, sizeof(CODE));
+	if (!c) {
+		lisp_error(L"out of memory for compiled code");
+		return NULL;
+	}
+	c->name = name;
+	c->nargs = nargs;
+	c->next = ev->codeList;
+	if (ev->codeList) {
+		ev->codeList->prev = c;
+	}
+	ev->codeList = c;
+	return c;
+}
+
+static void free_code(CODE* c)
+{
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		ev->codeList = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+	free(c->bytes);
+	free(c->consts);
+	free(c);
+}
+
+// true if c is running in a frame of the VM
+static bool code_running(CODE* c)
 {
-	if (!consp(formals)) {
-		return prev;
+	for (int i = 0; i < ev->vmFrameCount; i++) {
+		if (ev->vmFrames[i].code == c) {
+			return true;
+		}
 	}
-	return cons(cons(car(formals), consp(acts) ? eval(car(acts)) : NIL), bind_args(cdr(formals), consp(acts) ? cdr(acts) : NIL, prev));
+	return false;
 }
 
-LISPTR apply(LISPTR f, LISPTR args)
+static void mark_code(void)
+{
+	for (CODE* c = ev->codeList; c; c = c->next) {
+		lisp_gc_mark(c->name);
+		for (int i = 0; i < c->constCount; i++) {
+			lisp_gc_mark(c->consts[i]);
+		}
+	}
+	for (int i = 0; i < ev->vmTop; i++) {
+		lisp_gc_mark(ev->vmStack[i]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////
+// code in heap images
+// Code is saved in codeList order, and referred to by its position there.
+
+int lisp_code_index(LISPTR x)
+{
+	int i = 0;
+	for (CODE* c = ev->codeList; c; c = c->next, i++) {
+		if (lisp_tagged(c, TAG_CODE) == x) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+LISPTR lisp_code_at(int i)
+{
+	CODE* c = ev->codeList;
+	while (c && i-- > 0) {
+		c = c->next;
+	}
+	return c ? lisp_tagged(c, TAG_CODE) : NIL;
+}
+
+bool lisp_save_code(FILE* out)
+{
+	int count = 0;
+	for (CODE* c = ev->codeList; c; c = c->next) {
+		count++;
+	}
+	bool ok = fwrite(&count, sizeof count, 1, out) == 1;
+	for (CODE* c = ev->codeList; ok && c; c = c->next) {
+		LISP_IMAGE_REF name = lisp_image_ref(c->name);
+		ok = fwrite(&name, sizeof name, 1, out) == 1 &&
+			 fwrite(&c->nargs, sizeof c->nargs, 1, out) == 1 &&
+			 fwrite(&c->byteCount, sizeof c->byteCount, 1, out) == 1 &&
+			 fwrite(&c->constCount, sizeof c->constCount, 1, out) == 1 &&
+			 fwrite(c->bytes, 1, c->byteCount, out) == (size_t)c->byteCount;
+		for (int i = 0; ok && i < c->constCount; i++) {
+			LISP_IMAGE_REF k = lisp_image_ref(c->consts[i]);
+			ok = fwrite(&k, sizeof k, 1, out) == 1;
+		}
+	}
+	return ok;
+} // lisp_save_code
+
+// Replace all code with the code saved in an image.
+// Names and constants are left as image references, for lisp_relocate_code.
+bool lisp_load_code(FILE* in)
 {
-	if (symbolp(f)) {
-		// get the function binding of f
-		f = symbol_function(f);
-		if (consp(f)) {
-			// function defined as S-expr
-			if (car(f) == LAMBDA) {
-				LISPTR oldBindings = lexvars;
-				// bind formal arguments to evaluated actual arguments:
-				lexvars = bind_args(cadr(f), args, lexvars);
-				f = progn(cddr(f));
-				lexvars = oldBindings;
+	while (ev->codeList) {
+		free_code(ev->codeList);
+	}
+	int count;
+	if (fread(&count, sizeof count, 1, in) != 1) {
+		return false;
+	}
+	CODE* last = NULL;
+	for (int n = 0; n < count; n++) {
+		CODE* c = (CODE*)calloc(1, sizeof(CODE));
+		if (!c) {
+			return false;
+		}
+		// keep them in the order they were saved
+		c->prev = last;
+		if (last) {
+			last->next = c;
+		} else {
+			ev->codeList = c;
+		}
+		last = c;
+		LISP_IMAGE_REF name;
+		if (fread(&name, sizeof name, 1, in) != 1 ||
+			fread(&c->nargs, sizeof c->nargs, 1, in) != 1 ||
+			fread(&c->byteCount, sizeof c->byteCount, 1, in) != 1 ||
+			fread(&c->constCount, sizeof c->constCount, 1, in) != 1) {
+			return false;
+		}
+		c->name = (LISPTR)name;
+		c->byteCapacity = c->byteCount;
+		c->constCapacity = c->constCount;
+		c->bytes = (unsigned char*)malloc(c->byteCount ? c->byteCount : 1);
+		c->consts = (LISPTR*)malloc((c->constCount ? c->constCount : 1) * sizeof(LISPTR));
+		if (!c->bytes || !c->consts ||
+			fread(c->bytes, 1, c->byteCount, in) != (size_t)c->byteCount) {
+			return false;
+		}
+		for (int i = 0; i < c->constCount; i++) {
+			LISP_IMAGE_REF k;
+			if (fread(&k, sizeof k, 1, in) != 1) {
+				return false;
 			}
-		} else if (compiled_function_p(f)) {
-			// call compiled function with args
-			f = call_compiled_fn(f, args);
+			c->consts[i] = (LISPTR)k;
+		}
+	}
+	return true;
+} // lisp_load_code
+
+void lisp_relocate_code(void)
+{
+	for (CODE* c = ev->codeList; c; c = c->next) {
+		c->name = lisp_image_ptr((LISP_IMAGE_REF)c->name);
+		for (int i = 0; i < c->constCount; i++) {
+			c->consts[i] = lisp_image_ptr((LISP_IMAGE_REF)c->consts[i]);
 		}
 	}
-	return f;
 }
 
-// evaluate form x with lexical bindings a
-LISPTR eval(LISPTR x)
+///////////////////////////////////////////////////////////////////////
+// compiler
+
+typedef struct {
+	CODE*			code;
+	LISPTR			formals;		// parameter list, slot i is the ith
+	bool			failed;
+} COMPILER;
+
+static void emit(COMPILER* cc, int b)
+{
+	CODE* c = cc->code;
+	if (!reserve((void**)&c->bytes, &c->byteCapacity, c->byteCount, 1, 1)) {
+		cc->failed = true;
+		return;
+	}
+	c->bytes[c->byteCount++] = (unsigned char)b;
+}
+
+static void emit16(COMPILER* cc, int n)
 {
-	if (consp(x)) {
-		// evaluate a form
-		LISPTR f = car(x);
+	emit(cc, n & 0xFF);
+	emit(cc, (n >> 8) & 0xFF);
+}
+
+// index of x in the constant vector, adding it if need be
+static int constant(COMPILER* cc, LISPTR x)
+{
+	CODE* c = cc->code;
+	for (int i = 0; i < c->constCount; i++) {
+		if (c->consts[i] == x) {
+			return i;
+		}
+	}
+	if (c->constCount == MAX_CODE_CONSTS ||
+		!reserve((void**)&c->consts, &c->constCapacity, c->constCount, 1, sizeof(LISPTR))) {
+		cc->failed = true;
+		return 0;
+	}
+	c->consts[c->constCount] = x;
+	return c->constCount++;
+}
+
+// frame slot of variable x, -1 if it isn't a parameter
+static int local_slot(COMPILER* cc, LISPTR x)
+{
+	int i = 0;
+	for (LISPTR p = cc->formals; consp(p); p = cdr(p), i++) {
+		if (car(p) == x) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Emit a jump with a placeholder offset, returning where to patch it.
+static int emit_jump(COMPILER* cc, int op)
+{
+	emit(cc, op);
+	emit16(cc, 0);
+	return cc->code->byteCount;
+}
+
+static void patch_jump(COMPILER* cc, int from)
+{
+	if (cc->failed) {
+		return;
+	}
+	int d = cc->code->byteCount - from;
+	if (d > 0xFFFF) {
+		lisp_error(L"function too big to compile");
+		cc->failed = true;
+		return;
+	}
+	cc->code->bytes[from-2] = (unsigned char)(d & 0xFF);
+	cc->code->bytes[from-1] = (unsigned char)((d >> 8) & 0xFF);
+}
+
+static void compile_form(COMPILER* cc, LISPTR x);
+
+static void compile_body(COMPILER* cc, LISPTR body)
+{
+	if (!consp(body)) {
+		emit(cc, OP_CONST);
+		emit16(cc, constant(cc, NIL));
+		return;
+	}
+	while (true) {
+		compile_form(cc, car(body));
+		body = cdr(body);
+		if (!consp(body)) {
+			break;
+		}
+		emit(cc, OP_POP);
+	}
+}
+
+static void compile_call(COMPILER* cc, LISPTR f, LISPTR args)
+{
+	if (fsubrp(symbol_function(f))) {
+		emit(cc, OP_CALLF);
+		emit16(cc, constant(cc, f));
+		emit16(cc, constant(cc, args));
+		return;
+	}
+	int n = 0;
+	for (; consp(args); args = cdr(args)) {
+		if (n == MAX_CODE_ARGS) {
+			lisp_error(L"too many arguments in call");
+			cc->failed = true;
+			return;
+		}
+		compile_form(cc, car(args));
+		n++;
+	}
+	emit(cc, OP_CALL);
+	emit16(cc, constant(cc, f));
+	emit(cc, n);
+}
+
+static void compile_form(COMPILER* cc, LISPTR x)
+{
+	if (cc->failed) {
+		return;
+	}
+	if (symbolp(x) && x != NIL && x != T) {
+		int slot = local_slot(cc, x);
+		if (slot >= 0) {
+			emit(cc, OP_LOCAL);
+			emit(cc, slot);
+		} else {
+			emit(cc, OP_GLOBAL);
+			emit16(cc, constant(cc, x));
+		}
+	} else if (!consp(x)) {
+		// everything else evaluates to itself
+		emit(cc, OP_CONST);
+		emit16(cc, constant(cc, x));
+	} else {
+		LISPTR op = car(x);
 		LISPTR args = cdr(x);
-		x = apply(f, args);
-	} else if (stringp(x) || numberp(x)) {
-		return x;
-	} else if (symbolp(x)) {
-		LISPTR binding = assoc(x, lexvars);
-		if (binding != NIL) {
-			x = cdr(binding);
+		if (op == QUOTE) {
+			emit(cc, OP_CONST);
+			emit16(cc, constant(cc, car(args)));
+		} else if (op == ev->IF) {
+			// (IF test then [else])
+			compile_form(cc, car(args));
+			int toElse = emit_jump(cc, OP_JUMPNIL);
+			compile_form(cc, cadr(args));
+			int toEnd = emit_jump(cc, OP_JUMP);
+			patch_jump(cc, toElse);
+			compile_form(cc, caddr(args));
+			patch_jump(cc, toEnd);
+		} else if (op == ev->PROGN) {
+			compile_body(cc, args);
+		} else if (op == ev->SETQ) {
+			// (SETQ var value)
+			LISPTR var = car(args);
+			if (!symbolp(var) || var == NIL || var == T) {
+				lisp_error(L"bad variable in SETQ");
+				cc->failed = true;
+				return;
+			}
+			compile_form(cc, cadr(args));
+			int slot = local_slot(cc, var);
+			if (slot >= 0) {
+				emit(cc, OP_SETLOCAL);
+				emit(cc, slot);
+			} else {
+				emit(cc, OP_SETGLOBAL);
+				emit16(cc, constant(cc, var));
+			}
+		} else if (symbolp(op)) {
+			compile_call(cc, op, args);
 		} else {
-			x = symbol_value(x);
+			// not a function name: the form's value is its car
+			emit(cc, OP_CONST);
+			emit16(cc, constant(cc, op));
+		}
+	}
+} // compile_form
+
+// Compile (LAMBDA formals . body), returning the CODE, or NIL on error.
+LISPTR lisp_compile(LISPTR name, LISPTR formals, LISPTR body)
+{
+	int nargs = 0;
+	for (LISPTR p = formals; consp(p); p = cdr(p)) {
+		if (!symbolp(car(p))) {
+			lisp_error(L"parameter is not a symbol");
+			return NIL;
 		}
+		nargs++;
+	}
+	if (nargs > MAX_CODE_ARGS) {
+		lisp_error(L"too many parameters");
+		return NIL;
+	}
+	COMPILER cc;
+	cc.code = new_code(name, nargs);
+	cc.formals = formals;
+	cc.failed = (cc.code == NULL);
+	if (cc.failed) {
+		return NIL;
+	}
+	compile_body(&cc, body);
+	emit(&cc, OP_RETURN);
+	if (cc.failed) {
+		free_code(cc.code);
+		return NIL;
 	}
+	return lisp_tagged(cc.code, TAG_CODE);
+} // lisp_compile
+
+///////////////////////////////////////////////////////////////////////
+// VM
+
+static inline bool push(LISPTR x)
+{
+	if (ev->vmTop == ev->vmCapacity && !reserve((void**)&ev->vmStack, &ev->vmCapacity, ev->vmTop, 1, sizeof(LISPTR))) {
+		return false;
+	}
+	ev->vmStack[ev->vmTop++] = x;
+	return true;
+}
+
+static bool push_frame(CODE* code, int base)
+{
+	if (ev->vmFrameCount == MAX_VM_FRAMES) {
+		lisp_error(L"calls nested too deeply - runaway recursion?");
+		return false;
+	}
+	if (!reserve((void**)&ev->vmFrames, &ev->vmFrameCapacity, ev->vmFrameCount, 1, sizeof(FRAME))) {
+		return false;
+	}
+	FRAME* fr = &ev->vmFrames[ev->vmFrameCount++];
+	fr->code = code;
+	fr->pc = 0;
+	fr->base = base;
+	return true;
+}
+
+// The function a call to symbol f reaches. A LAMBDA expression left
+// in a function cell is compiled the first time it is called.
+static LISPTR function_of(LISPTR f)
+{
+	LISPTR fn = symbol_function(f);
+	if (consp(fn) && car(fn) == LAMBDA) {
+		LISPTR code = lisp_compile(f, cadr(fn), cddr(fn));
+		if (code != NIL) {
+			set_symbol_function(f, code);
+			fn = code;
+		}
+	}
+	return fn;
+}
+
+// Run the VM until the frame on top when it was called returns.
+static LISPTR vm_execute(void)
+{
+	int entry = ev->vmFrameCount;
+	FRAME* fr = &ev->vmFrames[ev->vmFrameCount-1];
+	const unsigned char* pc = fr->code->bytes + fr->pc;
+	LISPTR* consts = fr->code->consts;
+	while (true) {
+		int op = *pc++;
+		switch (op) {
+		case OP_CONST:
+			if (!push(consts[pc[0] | (pc[1] << 8)])) goto fail;
+			pc += 2;
+			break;
+		case OP_LOCAL:
+			if (!push(ev->vmStack[fr->base + pc[0]])) goto fail;
+			pc += 1;
+			break;
+		case OP_GLOBAL:
+			if (!push(symbol_value(consts[pc[0] | (pc[1] << 8)]))) goto fail;
+			pc += 2;
+			break;
+		case OP_SETLOCAL:
+			ev->vmStack[fr->base + pc[0]] = ev->vmStack[ev->vmTop-1];
+			pc += 1;
+			break;
+		case OP_SETGLOBAL:
+			defvar(consts[pc[0] | (pc[1] << 8)], ev->vmStack[ev->vmTop-1]);
+			pc += 2;
+			break;
+		case OP_POP:
+			ev->vmTop--;
+			break;
+		case OP_JUMP:
+			pc += 2 + (pc[0] | (pc[1] << 8));
+			break;
+		case OP_JUMPNIL:
+			if (ev->vmStack[--ev->vmTop] == NIL) {
+				pc += 2 + (pc[0] | (pc[1] << 8));
+			} else {
+				pc += 2;
+			}
+			break;
+		case OP_CALL: {
+			LISPTR f = consts[pc[0] | (pc[1] << 8)];
+			int n = pc[2];
+			pc += 3;
+			LISPTR fn = function_of(f);
+			if (codep(fn)) {
+				CODE* callee = CODE_OF(fn);
+				// missing arguments are NIL, extra ones are dropped
+				for (; n < callee->nargs; n++) {
+					if (!push(NIL)) goto fail;
+				}
+				ev->vmTop -= n - callee->nargs;
+				fr->pc = (int)(pc - fr->code->bytes);
+				if (!push_frame(callee, ev->vmTop - callee->nargs)) goto fail;
+				fr = &ev->vmFrames[ev->vmFrameCount-1];
+				pc = callee->bytes;
+				consts = callee->consts;
+			} else {
+				LISPTR v;
+				if (compiled_function_p(fn)) {
+					LISPTR args[3];
+					for (int i = 0; i < n && i < 3; i++) {
+						args[i] = ev->vmStack[ev->vmTop-n+i];
+					}
+					// the SUBR may run Lisp itself, so save our place
+					fr->pc = (int)(pc - fr->code->bytes);
+					v = call_subr(fn, args, n < 3 ? n : 3);
+					fr = &ev->vmFrames[ev->vmFrameCount-1];
+				} else {
+					v = fn;		// not a function: the call's value is whatever is there
+				}
+				ev->vmTop -= n;
+				if (!push(v)) goto fail;
+			}
+			break;
+		}
+		case OP_CALLF: {
+			LISPTR f = consts[pc[0] | (pc[1] << 8)];
+			LISPTR args = consts[pc[2] | (pc[3] << 8)];
+			pc += 4;
+			fr->pc = (int)(pc - fr->code->bytes);
+			LISPTR v = call_compiled_fn(symbol_function(f), args);
+			fr = &ev->vmFrames[ev->vmFrameCount-1];
+			if (!push(v)) goto fail;
+			break;
+		}
+		case OP_RETURN: {
+			LISPTR v = ev->vmStack[ev->vmTop-1];
+			ev->vmTop = fr->base;
+			ev->vmFrameCount--;
+			if (ev->vmFrameCount < entry) {
+				return v;
+			}
+			ev->vmStack[ev->vmTop++] = v;		// there's room: the callee's frame was at least this big
+			fr = &ev->vmFrames[ev->vmFrameCount-1];
+			pc = fr->code->bytes + fr->pc;
+			consts = fr->code->consts;
+			break;
+		}
+		default:
+			lisp_error(L"bad bytecode");
+			goto fail;
+		} // switch
+	}
+fail:
+	// unwind whatever this call pushed
+	ev->vmTop = ev->vmFrames[entry-1].base;
+	ev->vmFrameCount = entry-1;
+	return NIL;
+} // vm_execute
+
+LISPTR lisp_run(LISPTR code)
+{
+	if (!codep(code)) {
+		return NIL;
+	}
+	if (!push_frame(CODE_OF(code), ev->vmTop)) {
+		return NIL;
+	}
+	return vm_execute();
+}
+
+///////////////////////////////////////////////////////////////////////
+// evaluator
+
+// (DEFUN name formals . body)
+static LISPTR defun(LISPTR args)
+{
+	LISPTR name = car(args);
+	if (!symbolp(name) || name == NIL) {
+		lisp_error(L"bad function name in DEFUN");
+		return NIL;
+	}
+	LISPTR code = lisp_compile(name, cadr(args), cddr(args));
+	if (code == NIL) {
+		return NIL;
+	}
+	// The code being replaced can't be reached once it's out of the
+	// function cell, unless it is running - a function that redefines
+	// itself - in which case it's left to be freed with the rest.
+	LISPTR old = symbol_function(name);
+	set_symbol_function(name, code);
+	if (codep(old) && !code_running(CODE_OF(old))) {
+		free_code(CODE_OF(old));
+	}
+	return name;
+}
+
+void init_lisp_eval(void)
+{
+	ev->IF = intern(L"IF");
+	ev->PROGN = intern(L"PROGN");
+	ev->SETQ = intern(L"SETQ");
+	def_fsubr(L"DEFUN", defun);
+	lisp_gc_add_marker(mark_code);
+}
+
+void* lisp_eval_create(void)
+{
+	return calloc(1, sizeof(EVAL_STATE));
+}
+
+void lisp_eval_switch(void* state)
+{
+	ev = (EVAL_STATE*)state;
+}
+
+void lisp_shutdown_eval(void)
+{
+	while (ev->codeList) {
+		free_code(ev->codeList);
+	}
+	free(ev->vmStack);
+	free(ev->vmFrames);
+	free(ev);
+	ev = NULL;
+}
+
+// evaluate form x, compiling it and running the result
+LISPTR eval(LISPTR x)
+{
+	LISPTR code = lisp_compile(NIL, NIL, cons(x, NIL));
+	if (code == NIL) {
+		return NIL;
+	}
+	x = lisp_run(code);
+	free_code(CODE_OF(code));
 	return x;
 }
 
 LISPTR lisp_eval(LISPTR x)
 {
-	LISPTR oldBindings = lexvars;
-	lexvars = NIL;
-	// evaluate with no lexical bindings:
-	x = eval(x);
-	lexvars = oldBindings;
-	return x;
+	return eval(x);
 }
 
 LISPTR progn(LISPTR x)
@@ -87,5 +732,6 @@ void lisp_REPL(FILE* in, FILE* out, FILE* err)
 		fputs("lisp_eval => ", out);
 		lisp_print(v, out);
 		fputs("\n", out);
+		fflush(out);		// for a program driving the REPL through a pipe
 	}
-}
\ No newline at end of file
+}
@@ -1,120 +1,338 @@
 #include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>	// for fstat
+#if defined(_MSC_VER)
+#include <io.h>			// for _read
+#else
+#include <unistd.h>		// for read
+#endif
 #include "lisp.h"
 
-#define MAX_ATOM_CHARS 1024
+#define MAX_ATOM_BYTES 4096
+#define READ_BLOCK_SIZE (64 * 1024)
+#define READ_EOF (-1)
 
-static bool isnumber(const wchar_t* s)
+// Input is read a block at a time and decoded from UTF-8 as it is
+// tokenized, so there is no library call per character. Atoms are
+// encoded back into UTF-8, which is how the heap keeps names. Only a
+// regular file is read a whole block at a time. From a terminal, pipe or
+// FIFO the reader takes whatever input has arrived, so the REPL still
+// answers each line as it is typed or sent.
+// Each Lisp has one block buffer: reading from a different stream discards
+// whatever was buffered from the last one.
+typedef struct {
+	FILE*			in;
+	bool			regular;		// reading a regular file
+	int				pos;			// next byte of buf to read
+	int				len;			// bytes in buf
+	unsigned char	buf[READ_BLOCK_SIZE];
+} READER;
+
+static LISP_THREAD READER* reader;	// the current Lisp's
+
+static READER* reader_for(FILE* in)
+{
+	READER* r = reader;
+	if (r->in != in) {
+		r->in = in;
+		r->pos = r->len = 0;
+#if defined(_MSC_VER)
+		struct _stat st;
+		r->regular = _fstat(_fileno(in), &st) == 0 && (st.st_mode & _S_IFMT) == _S_IFREG;
+#else
+		struct stat st;
+		r->regular = fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode);
+#endif
+	}
+	return r;
+}
+
+// The reader's part of a Lisp
+void* lisp_reader_create(void)
+{
+	return calloc(1, sizeof(READER));
+}
+
+void lisp_reader_switch(void* state)
+{
+	reader = (READER*)state;
+}
+
+void lisp_reader_shutdown(void)
+{
+	free(reader);
+	reader = NULL;
+}
+
+// Refill the buffer, returning false at end of input.
+static bool refill(READER* r)
+{
+	r->pos = 0;
+	if (r->regular) {
+		r->len = (int)fread(r->buf, 1, READ_BLOCK_SIZE, r->in);
+	} else {
+		// fread would wait for a whole block; read returns what's there
+#if defined(_MSC_VER)
+		int n = _read(_fileno(r->in), r->buf, READ_BLOCK_SIZE);
+#else
+		ssize_t n;
+		do {
+			n = read(fileno(r->in), r->buf, READ_BLOCK_SIZE);
+		} while (n < 0 && errno == EINTR);
+#endif
+		r->len = n > 0 ? (int)n : 0;
+	}
+	return r->len > 0;
+}
+
+static inline int next_byte(READER* r)
 {
-	if (isdigit(*s)) {
+	if (r->pos == r->len && !refill(r)) {
+		return READ_EOF;
+	}
+	return r->buf[r->pos++];
+}
+
+// Put back the byte just read. There's always room, because it came
+// from the buffer.
+static inline void unread_byte(READER* r)
+{
+	r->pos--;
+}
+
+// Decode the next character, READ_EOF at end of input.
+// Malformed UTF-8 becomes U+FFFD.
+static int next_char(READER* r)
+{
+	int c = next_byte(r);
+	if (c < 0x80) {
+		return c;					// ASCII, or READ_EOF
+	}
+	int more;
+	if (c >= 0xF0 && c < 0xF8) {
+		c &= 0x07; more = 3;
+	} else if (c >= 0xE0) {
+		c &= 0x0F; more = 2;
+	} else if (c >= 0xC0) {
+		c &= 0x1F; more = 1;
+	} else {
+		return 0xFFFD;				// stray continuation byte
+	}
+	while (more-- > 0) {
+		int b = next_byte(r);
+		if ((b & 0xC0) != 0x80) {
+			if (b != READ_EOF) {
+				unread_byte(r);
+			}
+			return 0xFFFD;
+		}
+		c = (c << 6) | (b & 0x3F);
+	}
+	return c;
+} // next_char
+
+static inline bool is_space(int c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool is_digit(int c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static bool isnumber(const char* s)
+{
+	if (is_digit(*s)) {
 		return true;
 	}
-	if ((s[0]=='-' || s[0]=='.') && isdigit(s[1])) {
+	if ((s[0]=='-' || s[0]=='.') && is_digit(s[1])) {
 		return true;
 	}
 	return false;
 } // isnumber
 
-LISPTR lisp_read(FILE* in)
+static int skip_space(READER* r)
 {
-	LISPTR s = NIL;
-	wchar_t ch = fgetwc(in);
-	while (iswspace(ch)) {
-		ch = fgetwc(in);
+	int c = next_char(r);
+	while (is_space(c)) {
+		c = next_char(r);
 	}
-	if (ch == '(') {
-		// start of cons
-		LISPTR last = s = cons(lisp_read(in), NIL);
-		while (true) {
-			ch = fgetwc(in); while (iswspace(ch)) { ch = fgetwc(in); }
-			if (ch==WEOF || ch==')') { break; }
-			ungetwc(ch, in);
-			LISPTR e = lisp_read(in);
-			rplacd(last, cons(e, NIL));
-			last = cdr(last);
+	return c;
+}
+
+// Read the rest of an atom - number, symbol or string - starting with c.
+// Symbols and numbers are upcased, strings are kept as written.
+static LISPTR read_atom(READER* r, int c)
+{
+	char name[MAX_ATOM_BYTES];
+	int n = 0;
+	bool isString = (c == '"');
+	while (true) {
+		if (!isString) {
+			if (c >= 'a' && c <= 'z') {
+				c -= 'a' - 'A';
+			} else if (c >= 0x80) {
+				c = (int)towupper((wint_t)c);
+			}
+		}
+		if (c < 0x80 && n < MAX_ATOM_BYTES-1) {
+			name[n++] = (char)c;
+		} else if (n < MAX_ATOM_BYTES-4) {
+			n += utf8_encode(name+n, c);
+		}
+		c = next_char(r);
+		if (c==READ_EOF) break;				// better not be inside a string, eh?
+		if (!isString) {
+			if (is_space(c)) break;
+			if (c==')' || c=='(') {
+				unread_byte(r);
+				break;
+			}
+		} else {
+			// collecting a string
+			if (c=='\\') {
+				c = next_char(r);
+				if (c==READ_EOF) break;		// bad luck er bad string syntax
+			} else if (c=='"') {
+				break;				// end of string
+			}
 		}
-	} else if (ch == '\'') {
-		// '<expr>, sugar for (QUOTE <expr>)
-		s = cons(QUOTE, cons(lisp_read(in), NIL));
-	} else if (ch == '#') {
-		// so-called sharpsign or 'dispatching macro character'
-		// http://www.lispworks.com/documentation/HyperSpec/Body/02_dh.htm
-		ch = fgetwc(in);
-		switch (ch) {
-		case '\'':				// function-quote
-			s = cons(FUNCTION, cons(lisp_read(in), NIL));
-			break;
-		default:
-			lisp_error(L"invalid char after #");
-			break;
-		} // switch
-	} else if (ch == WEOF) {
-		// end of file, return NIL.
+	} // while (true)
+	name[n] = 0;
+	if (isString) {
+		return intern_string_utf8(name+1, n-1);
+	} else if (isnumber(name)) {
+		return intern_number(name);
 	} else {
-		// must be an atom - number, symbol or string
-		wchar_t name[MAX_ATOM_CHARS];
-		int n = 0;
-		while (true) {
-			if (n < MAX_ATOM_CHARS) {
-				name[n++] = towupper(ch);
+		return intern_utf8(name, n);
+	}
+} // read_atom
+
+// Lists still being read are kept on a stack, innermost first.
+// Each entry is ((head . last) . wrapper). A wrapper, like the
+// (QUOTE x) that 'x stands for, is complete after one element.
+static LISPTR push_pending(LISPTR pending, LISPTR head, bool wrapper)
+{
+	return cons(cons(cons(head, head), wrapper ? T : NIL), pending);
+}
+
+static inline bool pending_wrapper(LISPTR pending)
+{
+	return cdr(car(pending)) != NIL;
+}
+
+// the list being read by the innermost pending entry
+static inline LISPTR pending_list(LISPTR pending)
+{
+	return car(car(car(pending)));
+}
+
+// Read and return the next S-expression.
+// Nested lists are kept on a stack of pending lists in the heap,
+// rather than by recursing.
+LISPTR lisp_read(FILE* in)
+{
+	READER* r = reader_for(in);
+	LISPTR pending = NIL;
+	while (true) {
+		LISPTR x;
+		int ch = skip_space(r);
+		if (ch == '(') {
+			// start of cons
+			pending = push_pending(pending, NIL, false);
+			continue;
+		} else if (ch == ')') {
+			if (pending == NIL || pending_wrapper(pending)) {
+				lisp_error(L"unexpected )");
+				continue;
 			}
-			ch = fgetwc(in);
-			if (ch==WEOF) break;				// better not be inside a string, eh?
-			if (name[0] != '"') {
-				// not a string
-				if (iswspace(ch)) break;
-				if (ch==')' || ch=='(') {
-					ungetwc(ch, in);
-					break;
-				}
+			x = pending_list(pending);
+			pending = cdr(pending);
+		} else if (ch == '\'') {
+			// '<expr>, sugar for (QUOTE <expr>)
+			pending = push_pending(pending, cons(QUOTE, NIL), true);
+			continue;
+		} else if (ch == '#') {
+			// so-called sharpsign or 'dispatching macro character'
+			// http://www.lispworks.com/documentation/HyperSpec/Body/02_dh.htm
+			ch = next_char(r);
+			if (ch != '\'') {
+				lisp_error(L"invalid char after #");
+				x = NIL;
 			} else {
-				// collecting a string
-				if (ch=='\\') {
-					ch = fgetwc(in);
-					if (ch==WEOF) break;		// bad luck er bad string syntax
-				} else if (ch=='"') {
-					break;				// end of string
-				}
+				// function-quote
+				pending = push_pending(pending, cons(FUNCTION, NIL), true);
+				continue;
+			}
+		} else if (ch == READ_EOF) {
+			// end of file, return NIL, or end whatever is pending
+			if (pending == NIL) {
+				return NIL;
+			}
+			if (pending_wrapper(pending)) {
+				x = NIL;
+			} else {
+				x = pending_list(pending);
+				pending = cdr(pending);
 			}
-		} // while (true)
-		name[n] = 0;
-		if (name[0] == '"') {
-			s = intern_string(name+1);
-		} else if (isnumber(name)) {
-			s = intern_number(name);
 		} else {
-			s = intern(name);
+			x = read_atom(r, ch);
+		}
+		// x is complete: append it to the innermost pending list,
+		// which completes that list if it's a wrapper.
+		while (pending != NIL) {
+			LISPTR ends = car(car(pending));		// (head . last)
+			LISPTR cell = cons(x, NIL);
+			if (car(ends) == NIL) {
+				rplaca(ends, cell);
+			} else {
+				rplacd(cdr(ends), cell);
+			}
+			rplacd(ends, cell);
+			if (!pending_wrapper(pending)) {
+				break;
+			}
+			x = car(ends);
+			pending = cdr(pending);
+		}
+		if (pending == NIL) {
+			return x;
 		}
 	}
-	return s;
-}
+} // lisp_read
 
 LISPTR lisp_print(LISPTR x, FILE* out)
 {
 	if (consp(x)) {
-		fputwc('(', out);
+		fputc('(', out);
 		while (true) {
 			lisp_print(car(x), out);
 			x = cdr(x);
 			if (!consp(x)) {
 				if (x != NIL) {
-					fputws(L" . ", out);
+					fputs(" . ", out);
 					lisp_print(x, out);
 				}
 				break;
 			}
-			fputwc(' ', out);
+			fputc(' ', out);
 		}
-		fputwc(')', out);
+		fputc(')', out);
 	} else if (symbolp(x)) {
-		fputws(string_text(symbol_name(x)), out);
+		fputs(string_text(symbol_name(x)), out);
 	} else if (numberp(x)) {
-		fwprintf(out, L"%g", number_value(x));
+		fprintf(out, "%g", number_value(x));
 	} else if (stringp(x)) {
-		fputwc('"', out);
-		fputws(string_text(x), out);
-		fputwc('"', out);
+		fputc('"', out);
+		fputs(string_text(x), out);
+		fputc('"', out);
 	} else {
-		fputws(L"*UNKOBJ*", out);
+		fputs("*UNKOBJ*", out);
 	}
 	return x;
 }
@@ -0,0 +1,86 @@
+// main.cpp : Defines the entry point for the console application.
+// The engine itself is in the isACTR library; this is just one client.
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <wchar.h>
+#include "version.h"
+#include "lisp.h"		// "Lisp" functions
+#include "isactr.h"		// isACTR API
+
+#ifdef _MSC_VER
+#define strtoull _strtoui64		// VS2010 has no strtoull
+#endif
+
+int main(int argc, char* argv[])
+{
+	int i;
+	FILE* in = stdin;
+	FILE* out = stdout;
+	const char* imagePath = NULL;		// -image <file>: start from this image
+	const char* saveImagePath = NULL;	// -save-image <file>: save an image once the model is loaded
+	int replications = 0;				// -batch <n>: run the model n times instead of the REPL
+	double duration = 60.0;				// -run <seconds>: how long each replication runs
+	unsigned long long seed = 0;		// -seed <n>: seed of the batch's random streams
+	int workers = 1;					// -workers <n>: run the batch in up to n processes at once
+	fprintf(out, "Industrial Strength ACT-R  %d.%d.%d.%d\n", VERSION_MAJOR, VERSION_MINOR, VERSION_RELEASE, VERSION_BUILD);
+	// arg 0 is the full path to this executable.
+	for (i = 1; i < argc; i++) {
+		printf("argv[%d] = '%s'\n", i, argv[i]);
+		if (argv[i][0] != '-') {
+			// not an option, assume it's an input file
+			if (in != stdin) {
+				fclose(in);
+			}
+			in = fopen(argv[i], "r");
+			if (!in) {
+				return errno;
+			}
+		} else if (strcmp(argv[i], "-image") == 0 && i+1 < argc) {
+			imagePath = argv[++i];
+		} else if (strcmp(argv[i], "-save-image") == 0 && i+1 < argc) {
+			saveImagePath = argv[++i];
+		} else if (strcmp(argv[i], "-batch") == 0 && i+1 < argc) {
+			replications = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-run") == 0 && i+1 < argc) {
+			duration = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-seed") == 0 && i+1 < argc) {
+			seed = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-workers") == 0 && i+1 < argc) {
+			workers = atoi(argv[++i]);
+		}
+	}
+	lisp_gc_stack_base(&argc);
+
+	isactr_context* cx = isactr_context_create(in, out, stderr);
+	if (!cx) {
+		fputs("no memory for the model\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if (imagePath && !isactr_load_image(imagePath)) {
+		return EXIT_FAILURE;
+	}
+	if (isactr_model_load(in, out, stderr)) {
+		if (saveImagePath) {
+			isactr_save_image(saveImagePath);
+		}
+		if (replications > 0) {
+			isactr_run_result* results = (isactr_run_result*)malloc(replications * sizeof(isactr_run_result));
+			bool ok = results && (workers > 1 ?
+				isactr_fork_batch_run(replications, workers, duration, seed, results) :
+				isactr_batch_run(0, replications, duration, seed, results));
+			if (ok) {
+				isactr_print_results(out, results, replications);
+			}
+			free(results);
+		} else {
+			lisp_REPL(stdin, stdout, stderr);
+		}
+	}
+	isactr_context_destroy(cx);
+	fgetwc(stdin);
+	return 0;
+}